@@ -2,7 +2,16 @@ GCC ?= $(shell if gcc-mp-4.8 --version | grep gcc >/dev/null; then echo gcc-mp-4
 	elif gcc-mp-4.7 --version | grep gcc >/dev/null; then echo gcc-mp-4.7; \
 	else echo gcc; fi 2>/dev/null)
 
-CFLAGS = -std=gnu99 -m32 -W -Wall -g
+# `make M64=1` builds a native 64-bit shell instead of the 32-bit default.
+# Either way, off_t, stat sizes and rlim_t are 64 bits wide, so files larger
+# than 2 GB can be redirected, globbed and limited.
+ifeq ($(M64),1)
+ARCHFLAGS =
+else
+ARCHFLAGS = -m32
+endif
+CFLAGS = -std=gnu99 $(ARCHFLAGS) -W -Wall -g
+CPPFLAGS += -D_FILE_OFFSET_BITS=64
 DEPCFLAGS = -MD -MF $(DEPSDIR)/$*.d -MP
 LDFLAGS =
 LIBS =
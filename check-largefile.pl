@@ -0,0 +1,76 @@
+#! /usr/bin/perl -w
+
+# check-largefile.pl
+#    Stream more than 4 GB through sh61's redirections and pipelines,
+#    checking byte counts and reporting throughput. Needs about twice
+#    LARGEFILE_SIZE bytes free in `out/` (the input file is sparse; the
+#    output files are not, and are removed as soon as they are counted).
+
+use Time::HiRes;
+
+my($Red, $Redctx, $Green, $Cyan, $Off) = ("\x1b[01;31m", "\x1b[0;31m", "\x1b[01;32m", "\x1b[01;36m", "\x1b[0m");
+$Red = $Redctx = $Green = $Cyan = $Off = "" if !-t STDERR || !-t STDOUT;
+
+my($size) = $ENV{"LARGEFILE_SIZE"} || 4608 * 1024 * 1024;
+my($sh) = "../sh61";
+
+-x "sh61" || die "./sh61 does not exist, so I can't run any tests!\n";
+-d "out" || mkdir("out") || die "Cannot create 'out' directory\n";
+
+# A sparse input file, so creating it costs no disk space or time.
+open(F, ">", "out/large.bin") || die "out/large.bin: $!\n";
+truncate(F, $size) || die "out/large.bin: $!\n";
+close(F);
+
+my(@tests) = (
+    # 0. Test title
+    # 1. Command
+    # 2. Number of times the data passes through the shell's redirections
+    #    and pipes, for the throughput figure
+    # (`wc -c < file` would just fstat the file, so read it through `cat`;
+    # `cat -u` keeps the optimizer from folding a `cat` stage away)
+    [ 'Input redirection',
+      'cat < large.bin | wc -c', 2 ],
+
+    [ 'Output redirection',
+      'cat large.bin > large2.bin ; wc -c < large2.bin ; rm -f large2.bin', 2 ],
+
+    [ 'Pipeline',
+      'cat -u large.bin | cat -u | wc -c', 2 ],
+
+    [ 'Redirected pipeline',
+      'cat < large.bin | cat -u | cat -u > large2.bin ; wc -c < large2.bin ; rm -f large2.bin', 4 ],
+    );
+
+my($ntest, $ntestfailed) = (0, 0);
+foreach my $test (@tests) {
+    my($desc, $command, $passes) = @$test;
+    ++$ntest;
+    print "$desc: ";
+
+    open(F, ">", "out/largefile.sh") || die;
+    print F $command, "\n";
+    close(F);
+
+    my($before) = Time::HiRes::time();
+    my($result) = `cd out && $sh -q largefile.sh 2>&1`;
+    my($delta) = Time::HiRes::time() - $before;
+    $result =~ s|\s+| |g;
+    $result =~ s|^\s+||;
+    $result =~ s|\s+$||;
+
+    if ($result eq $size) {
+        printf "${Green}passed${Off} in %.3f sec, %.0f MB/s\n",
+            $delta, $size * $passes / $delta / (1024 * 1024);
+    } else {
+        printf "${Red}FAILED${Redctx} in %.3f sec${Off}\n", $delta;
+        print "    command  \`$command\`\n";
+        print "    expected \`$size\`\n";
+        print "    got      \`$result\`\n";
+        ++$ntestfailed;
+    }
+}
+
+unlink("out/large.bin", "out/large2.bin", "out/largefile.sh");
+print $ntest - $ntestfailed, " of $ntest tests passed\n";
+exit($ntestfailed ? 1 : 0);
@@ -0,0 +1,61 @@
+#! /usr/bin/perl -w
+
+# check-sched.pl
+#    Measure foreground latency under a storm of CPU-bound background jobs,
+#    once for each background scheduling policy. The script sh61 runs
+#    starts the storm with `&`, then runs `date +%s%N` over and over in the
+#    foreground; the gaps between consecutive timestamps are the time it
+#    takes the shell to fork, exec and run one short foreground command.
+
+my($Red, $Redctx, $Green, $Cyan, $Off) = ("\x1b[01;31m", "\x1b[0;31m", "\x1b[01;32m", "\x1b[01;36m", "\x1b[0m");
+$Red = $Redctx = $Green = $Cyan = $Off = "" if !-t STDERR || !-t STDOUT;
+
+my($samples) = $ENV{"SCHED_SAMPLES"} || 300;
+my($jobs) = $ENV{"SCHED_JOBS"} || 2 * `nproc`;
+my($storm) = "sh61-storm-$$";
+my($sh) = "../sh61";
+
+-x "sh61" || die "./sh61 does not exist, so I can't run any tests!\n";
+-d "out" || mkdir("out") || die "Cannot create 'out' directory\n";
+
+open(F, ">", "out/sched.sh") || die "out/sched.sh: $!\n";
+print F "timeout 60 yes $storm > /dev/null &\n" x $jobs;
+print F "sleep 0.5\n";
+print F "date +%s%N\n" x ($samples + 1);
+close(F);
+
+my(@policies) = (
+    # 0. Title
+    # 1. sh61 options
+    [ 'bg=normal', '--bg=normal' ],
+    [ 'default', '' ],
+    [ 'bg=idle', '--bg=idle' ],
+    );
+
+print "$jobs background jobs, $samples foreground commands\n";
+my($nfailed) = 0;
+foreach my $policy (@policies) {
+    my($desc, $options) = @$policy;
+    # Background jobs keep a copy of sh61's stdout, so read the timestamps
+    # from a file rather than waiting for a pipe to close.
+    system("cd out && $sh -q $options sched.sh > sched.out");
+    system("pkill -f $storm");
+    open(F, "<", "out/sched.out") || die "out/sched.out: $!\n";
+    my(@stamps) = grep { /^\d+$/ } <F>;
+    close(F);
+
+    if (@stamps != $samples + 1) {
+        print "$desc: ${Red}FAILED${Redctx}: got ", scalar(@stamps),
+            " timestamps, expected ", $samples + 1, "${Off}\n";
+        ++$nfailed;
+        next;
+    }
+
+    my(@gaps) = sort { $a <=> $b }
+        map { ($stamps[$_ + 1] - $stamps[$_]) / 1e6 } 0 .. $samples - 1;
+    printf "%-10s p50 %7.2f ms   p99 %7.2f ms   max %7.2f ms\n", "$desc:",
+        $gaps[int($samples * 0.5)], $gaps[int($samples * 0.99)], $gaps[-1];
+}
+
+unlink("out/sched.sh", "out/sched.out");
+exit($nfailed ? 1 : 0);
@@ -407,7 +407,83 @@ sub CMD_MAX_TIME ()       { "CMD_MAX_TIME" }
     [ 'Test 71',
       'sleep 0.2 | wc -c | sed s/0/Second/ & sleep 0.1 | wc -c | sed s/0/First/',
       'First Second',
-      CMD_CLEANUP => 'sleep 0.25']
+      CMD_CLEANUP => 'sleep 0.25'],
+
+    [ 'Test 72 (Tracing)',
+      'env SH61_TRACE=trace%%.txt ../sh61 -q cmd%%.sh',
+      '1 "next":"skip"',
+      CMD_INIT => 'echo "test -z x && echo Unwanted" > cmd%%.sh',
+      CMD_CLEANUP => 'grep -c \'"name":"parse"\' trace%%.txt; grep -o \'"next":"[a-z]*"\' trace%%.txt' ],
+
+    [ 'Test 73 (Globbing)',
+      'echo ?%%.txt "?%%.txt" [ab]%%.t?t',
+      'a%%.txt b%%.txt ?%%.txt a%%.txt b%%.txt',
+      CMD_INIT => 'touch a%%.txt b%%.txt' ],
+
+    [ 'Test 74 (Nested shells)',
+      'sh -c "echo Inline#1 && false" || ../sh61 -q cmd%%.sh ; sh -c "false && echo Unwanted" || echo Failed ; sh -c "false && echo Unwanted | wc -c" < /dev/null',
+      'Inline#1 Nested Failed',
+      CMD_INIT => 'echo "echo Nested" > cmd%%.sh' ],
+
+    [ 'Test 75 (Optimizer)',
+      'cat in%%.txt | tr a-z A-Z | cat ; true && echo Folded ; false && echo Unwanted ; sh -c "false | cat" || echo Unwanted',
+      'LOWER Folded',
+      CMD_INIT => 'echo lower > in%%.txt' ],
+
+    [ 'Test 76',
+      '../sh61 --explain -q cmd%%.sh',
+      'sh61: plan: wc -c < in%%.txt 6',
+      CMD_INIT => 'echo lower > in%%.txt; echo "cat in%%.txt | wc -c | cat" > cmd%%.sh' ],
+
+    [ 'Test 77 (Command substitution)',
+      'echo [$(echo a b | tr a-z A-Z)] $(cat in%%.txt) "$(cd / && pwd)"',
+      '[A B] p q /',
+      CMD_INIT => 'printf "p\\nq\\n" > in%%.txt' ],
+
+    [ 'Test 78 (Scheduling classes)',
+      'cut -d" " -f19,41 /proc/self/stat > bg%%.txt & @idle cut -d" " -f41 /proc/self/stat',
+      '5 10 3',
+      CMD_CLEANUP => 'sleep 0.1; cat bg%%.txt' ],
+
+    [ 'Test 79 (Compiled scripts)',
+      '../sh61 -q cmd%%.sh61c ; echo "echo Edited" > cmd%%.sh ; ../sh61 -q cmd%%.sh61c',
+      'A b Z in%%.txt Edited',
+      CMD_INIT => 'echo a > in%%.txt; printf "cat < in%%.txt | tr a A; echo b\\necho z | tr z Z ; echo in%%.t?t\\n" > cmd%%.sh; ../sh61 --compile cmd%%.sh -o cmd%%.sh61c' ],
+
+    [ 'Test 80 (Prefetch)',
+      '../sh61 -q cmd%%.sh',
+      'Hello',
+      CMD_INIT => 'rm -f fifo%%; mkfifo fifo%%; { echo "/bin/sh -c \\"echo Hello > fifo%%\\" &"; echo "sleep 0.1"; for i in 1 2 3 4 5 6 7 8; do echo true; done; echo "cat < fifo%%"; } > cmd%%.sh',
+      CMD_CLEANUP => 'rm -f fifo%%' ],
+
+    [ 'Test 81 (Substitution order)',
+      'echo Hi > f%%.txt ; echo Got $(cat f%%.txt) ; false && echo $(echo Side > g%%.txt) ; test -e g%%.txt || echo Skipped ; cd / ; echo $(pwd)',
+      'Got Hi Skipped /' ],
+
+    [ 'Test 82',
+      'echo Redirected > $(echo r%%.txt) ; cat < r%%.txt',
+      'Redirected' ],
+
+    [ 'Test 83',
+      'env PATH=.:/bin:/usr/bin ../sh61 -q cmd%%.sh',
+      'Text script Second line of a text script that starts like a compiled one',
+      CMD_INIT => 'printf "#!/bin/sh\\necho Text script\\n" > sh61c%%; chmod +x sh61c%%; { echo sh61c%%; echo "echo Second line of a text script that starts like a compiled one"; } > cmd%%.sh',
+      CMD_CLEANUP => 'rm -f sh61c%%' ],
+
+    [ 'Test 84 (Argument batching)',
+      '../sh61 -b -q cmd%%.sh > b%%.txt ; test $(wc -l < b%%.txt) -gt 1 && echo Batched ; grep -cv "^Before .* After$" b%%.txt ; tr " " \'\\n\' < b%%.txt | grep -c ^d%%/ ; tr " " \'\\n\' < b%%.txt | grep ^d%%/ | sort -u | wc -l',
+      'Batched 0 12000 12000',
+      CMD_INIT => 'rm -rf d%%; mkdir d%% && cd d%% && seq -f "%0200g" 12000 | xargs touch; cd ..; echo "echo Before d%%/* After" > cmd%%.sh',
+      CMD_CLEANUP => 'rm -rf d%%' ],
+
+    [ 'Test 85',
+      '../sh61 --explain -q cmd%%.sh',
+      'sh61: plan: ../sh61 -q sub%%.sh Inner',
+      CMD_INIT => 'echo "echo Inner | cat" > sub%%.sh; echo "../sh61 -q sub%%.sh" > cmd%%.sh' ],
+
+    [ 'Test 86',
+      'echo Unwanted | $(true) ; echo After ; $(true) | cat ; echo x | $(printf "") && echo Empty ; echo Piped | $(echo cat)',
+      'After Empty Piped' ]
 
     # Command: sleep 5
     # Setup: output current unix time
@@ -0,0 +1,397 @@
+#include "sh61.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Precompiled scripts.
+//
+//    `sh61 --compile script -o script.sh61c` parses every line of a script
+//    once and writes the command lists to a file of four sections after a
+//    fixed header: a line table, a command table, a word table (string
+//    offsets for each command's arguments and redirections) and a pool of
+//    NUL-terminated, deduplicated strings. Every field is a fixed-width
+//    integer, and references are indexes or offsets rather than pointers,
+//    so the same file works for 32- and 64-bit builds and can be mapped
+//    anywhere.
+//
+//    Running the file maps it read-only, and the shell points its command
+//    structures straight at the mapped strings (see run_compiled in sh61.c).
+//    The header records the source's size, modification time and hash; a
+//    compiled script whose source has since changed is not used.
+
+typedef struct sh61c_buffer {
+    char* s;
+    size_t length;
+    size_t capacity;
+} sh61c_buffer;
+
+struct sh61c_writer {
+    sh61c_header header;
+    sh61c_buffer lines;
+    sh61c_buffer commands;
+    sh61c_buffer words;
+    sh61c_buffer strings;
+    uint32_t* string_table;     // open-addressed set of string offsets + 1
+    uint32_t string_slots;      // size of string_table; a power of two
+    uint32_t nstrings;
+    sh61c_line* line;           // line being added, in `lines`
+    uint32_t line_args;         // arguments on the current line
+    uint32_t line_redirects;    // redirections on the current line
+};
+
+
+// buffer_append(buf, data, n)
+//    Append `n` bytes from `data` to `buf`, doubling its capacity as needed.
+//    Returns the offset they were stored at.
+
+static size_t buffer_append(sh61c_buffer* buf, const void* data, size_t n) {
+    if (buf->length + n > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (buf->length + n > capacity)
+            capacity *= 2;
+        buf->s = (char*) realloc(buf->s, capacity);
+        buf->capacity = capacity;
+    }
+    memcpy(buf->s + buf->length, data, n);
+    buf->length += n;
+    return buf->length - n;
+}
+
+
+// hash_bytes(hash, data, n)
+//    Continue the 64-bit FNV-1a hash `hash` over `n` bytes of `data`.
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t n) {
+    const unsigned char* p = (const unsigned char*) data;
+    for (size_t i = 0; i < n; ++i)
+        hash = (hash ^ p[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+#define HASH_INIT           0xCBF29CE484222325ULL
+
+
+// hash_file(path, hash)
+//    Store the FNV-1a hash of the contents of `path` in `*hash`. Returns 0
+//    on success, -1 on error.
+
+static int hash_file(const char* path, uint64_t* hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    char buf[65536];
+    ssize_t n;
+    *hash = HASH_INIT;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno != EINTR) {
+            close(fd);
+            return -1;
+        } else if (n > 0)
+            *hash = hash_bytes(*hash, buf, n);
+    }
+    close(fd);
+    return 0;
+}
+
+
+// stat_mtime(st)
+//    Return the modification time in `st` in nanoseconds.
+
+static uint64_t stat_mtime(const struct stat* st) {
+    return (uint64_t) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+
+// writer_string(w, str)
+//    Add `str` to `w`'s string pool, unless it is already there, and return
+//    its offset.
+
+static uint32_t writer_string(sh61c_writer* w, const char* str) {
+    if (2 * (w->nstrings + 1) > w->string_slots) {
+        // grow the set, reinserting every string
+        uint32_t* old = w->string_table;
+        uint32_t old_slots = w->string_slots;
+        w->string_slots = old_slots ? old_slots * 2 : 1024;
+        w->string_table = (uint32_t*) calloc(w->string_slots, sizeof(uint32_t));
+        for (uint32_t i = 0; i < old_slots; ++i)
+            if (old[i]) {
+                const char* s = w->strings.s + old[i] - 1;
+                uint32_t slot = hash_bytes(HASH_INIT, s, strlen(s));
+                while (w->string_table[slot & (w->string_slots - 1)])
+                    ++slot;
+                w->string_table[slot & (w->string_slots - 1)] = old[i];
+            }
+        free(old);
+    }
+
+    size_t len = strlen(str);
+    uint32_t slot = hash_bytes(HASH_INIT, str, len);
+    uint32_t* entry;
+    while (*(entry = &w->string_table[slot & (w->string_slots - 1)])) {
+        if (strcmp(w->strings.s + *entry - 1, str) == 0)
+            return *entry - 1;
+        ++slot;
+    }
+    *entry = buffer_append(&w->strings, str, len + 1) + 1;
+    ++w->nstrings;
+    return *entry - 1;
+}
+
+
+// sh61c_begin(source)
+//    Start compiling the script file `source`, recording its identity.
+//    Returns NULL (after printing an error) if it can't be read.
+
+sh61c_writer* sh61c_begin(const char* source) {
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t hash;
+    if (!realpath(source, path) || stat(path, &st) == -1
+        || hash_file(path, &hash) == -1) {
+        perror(source);
+        return NULL;
+    }
+
+    sh61c_writer* w = (sh61c_writer*) calloc(1, sizeof(sh61c_writer));
+    memcpy(w->header.magic, SH61C_MAGIC, sizeof(w->header.magic));
+    w->header.source_mtime = stat_mtime(&st);
+    w->header.source_size = st.st_size;
+    w->header.source_hash = hash;
+    w->header.source = writer_string(w, path);
+    return w;
+}
+
+
+// sh61c_begin_line(w, text)
+//    Start the next line. If `text` is non-NULL, the line is stored as text
+//    to be parsed when it runs; otherwise its commands follow.
+
+void sh61c_begin_line(sh61c_writer* w, const char* text) {
+    sh61c_line line = { 0, w->commands.length / sizeof(sh61c_command), 0 };
+    if (text)
+        line.text = writer_string(w, text);
+    size_t off = buffer_append(&w->lines, &line, sizeof(line));
+    w->line = (sh61c_line*) (w->lines.s + off);
+    ++w->header.nlines;
+    w->line_args = w->line_redirects = 0;
+}
+
+
+// sh61c_add_command(w, argc, argv, condition_type, bg)
+//    Add a command to the current line.
+
+void sh61c_add_command(sh61c_writer* w, int argc, char** argv,
+                       int condition_type, int bg) {
+    sh61c_command c;
+    c.first = w->words.length / sizeof(uint32_t);
+    c.argc = argc;
+    c.nredirects = 0;
+    c.condition_type = condition_type;
+    c.bg = bg;
+    c.unused = 0;
+    buffer_append(&w->commands, &c, sizeof(c));
+    for (int i = 0; i < argc; ++i) {
+        uint32_t off = writer_string(w, argv[i]);
+        buffer_append(&w->words, &off, sizeof(off));
+    }
+
+    ++w->line->ncommands;
+    w->line_args += argc;
+    if (w->line->ncommands > w->header.max_commands)
+        w->header.max_commands = w->line->ncommands;
+    if (w->line_args > w->header.max_args)
+        w->header.max_args = w->line_args;
+}
+
+
+// sh61c_add_redirect(w, token, file)
+//    Add a redirection to the last command added.
+
+void sh61c_add_redirect(sh61c_writer* w, const char* token, const char* file) {
+    sh61c_command* c = (sh61c_command*) (w->commands.s + w->commands.length) - 1;
+    ++c->nredirects;
+    uint32_t off[2] = { writer_string(w, token), writer_string(w, file ? file : "") };
+    buffer_append(&w->words, off, sizeof(off));
+
+    ++w->line_redirects;
+    if (w->line_redirects > w->header.max_redirects)
+        w->header.max_redirects = w->line_redirects;
+}
+
+
+// write_all(fd, data, n)
+//    Write `n` bytes from `data` to `fd`. Returns 0 on success, -1 on error.
+
+static int write_all(int fd, const void* data, size_t n) {
+    const char* p = (const char*) data;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1 && errno != EINTR)
+            return -1;
+        else if (w > 0)
+            p += w, n -= w;
+    }
+    return 0;
+}
+
+
+// sh61c_finish(w, output)
+//    Write the compiled script to `output` and free `w`. The file is
+//    written under a temporary name and renamed into place, so shells
+//    running the old version keep a consistent mapping. Returns 0 on
+//    success, -1 (after printing an error) on failure.
+
+int sh61c_finish(sh61c_writer* w, const char* output) {
+    sh61c_header* h = &w->header;
+    h->lines = sizeof(*h);
+    h->commands = h->lines + w->lines.length;
+    h->words = h->commands + w->commands.length;
+    h->strings = h->words + w->words.length;
+    h->strings_size = w->strings.length;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", output, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    int r = -1;
+    if (fd != -1) {
+        if (write_all(fd, h, sizeof(*h)) == 0
+            && write_all(fd, w->lines.s, w->lines.length) == 0
+            && write_all(fd, w->commands.s, w->commands.length) == 0
+            && write_all(fd, w->words.s, w->words.length) == 0
+            && write_all(fd, w->strings.s, w->strings.length) == 0
+            && close(fd) == 0)
+            r = rename(tmp, output);
+        else
+            close(fd);
+    }
+    if (r == -1) {
+        perror(output);
+        unlink(tmp);
+    }
+
+    free(w->lines.s);
+    free(w->commands.s);
+    free(w->words.s);
+    free(w->strings.s);
+    free(w->string_table);
+    free(w);
+    return r;
+}
+
+
+// compiled_valid(cs)
+//    Return 1 if every section, index and string offset in `cs` lies
+//    within the file, so running it can't read outside the mapping.
+
+static int compiled_valid(const compiled_script* cs) {
+    const sh61c_header* h = cs->header;
+    size_t ncommands = (h->words - (size_t) h->commands) / sizeof(sh61c_command);
+    size_t nwords = (h->strings - (size_t) h->words) / sizeof(uint32_t);
+
+    if (h->lines != sizeof(*h)
+        || h->commands < h->lines + (size_t) h->nlines * sizeof(sh61c_line)
+        || h->words < h->commands || h->strings < h->words
+        || h->strings + (size_t) h->strings_size != cs->size
+        || h->strings_size == 0 || cs->strings[h->strings_size - 1] != '\0'
+        || h->source >= h->strings_size)
+        return 0;
+
+    for (uint32_t i = 0; i < h->nlines; ++i) {
+        const sh61c_line* line = &cs->lines[i];
+        if (line->ncommands > h->max_commands
+            || line->first + (size_t) line->ncommands > ncommands
+            || line->text >= h->strings_size)
+            return 0;
+        uint32_t args = 0, redirects = 0;
+        for (uint32_t j = line->first; j < line->first + line->ncommands; ++j) {
+            const sh61c_command* c = &cs->commands[j];
+            args += c->argc;
+            redirects += c->nredirects;
+            if (c->argc == 0 && j == line->first)
+                return 0;
+            if (c->first + (size_t) c->argc + 2 * (size_t) c->nredirects > nwords)
+                return 0;
+        }
+        if (args > h->max_args || redirects > h->max_redirects)
+            return 0;
+    }
+
+    for (size_t i = 0; i < nwords; ++i)
+        if (cs->words[i] >= h->strings_size)
+            return 0;
+    return 1;
+}
+
+
+// compiled_map(fd, cs)
+//    If `fd` is a compiled script, map it and describe it in `*cs`, and
+//    return 1. Return 0 if it is not a compiled script (its first 8 bytes
+//    aren't SH61C_MAGIC, format version included), and -1 (after printing
+//    an error) if it is one but can't be used.
+
+int compiled_map(int fd, compiled_script* cs) {
+    struct stat st;
+    char magic[sizeof(cs->header->magic)];
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+        || st.st_size < (off_t) sizeof(sh61c_header)
+        || pread(fd, magic, sizeof(magic), 0) != (ssize_t) sizeof(magic)
+        || memcmp(magic, SH61C_MAGIC, sizeof(magic)) != 0)
+        return 0;
+
+    if ((uint64_t) st.st_size > UINT32_MAX) {
+        fprintf(stderr, "sh61: compiled script too large\n");
+        return -1;
+    }
+
+    cs->size = st.st_size;
+    cs->map = mmap(NULL, cs->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (cs->map == MAP_FAILED) {
+        perror("sh61: mmap");
+        return -1;
+    }
+    const char* base = (const char*) cs->map;
+    cs->header = (const sh61c_header*) base;
+    cs->lines = (const sh61c_line*) (base + cs->header->lines);
+    cs->commands = (const sh61c_command*) (base + cs->header->commands);
+    cs->words = (const uint32_t*) (base + cs->header->words);
+    cs->strings = base + cs->header->strings;
+
+    if (!compiled_valid(cs)) {
+        fprintf(stderr, "sh61: corrupt compiled script\n");
+        compiled_unmap(cs);
+        return -1;
+    }
+    return 1;
+}
+
+
+// compiled_stale(cs)
+//    Return 1 if `cs`'s source file has changed since it was compiled. A
+//    source with a new modification time but the same size is hashed, so
+//    touching it doesn't force a fallback. A compiled script whose source
+//    is gone is used as it is.
+
+int compiled_stale(const compiled_script* cs) {
+    const sh61c_header* h = cs->header;
+    const char* source = cs->strings + h->source;
+    struct stat st;
+    uint64_t hash;
+    if (stat(source, &st) == -1)
+        return 0;
+    if ((uint64_t) st.st_size != h->source_size)
+        return 1;
+    if (stat_mtime(&st) == h->source_mtime)
+        return 0;
+    return hash_file(source, &hash) == -1 || hash != h->source_hash;
+}
+
+
+// compiled_unmap(cs)
+//    Release the mapping of `cs`.
+
+void compiled_unmap(compiled_script* cs) {
+    munmap(cs->map, cs->size);
+    cs->map = NULL;
+}
@@ -0,0 +1,245 @@
+#include "sh61.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+
+// Pathname expansion for `*`, `?` and `[...]`.
+//
+//    Directories are read with the raw getdents64 system call into a large
+//    buffer, which needs far fewer system calls than readdir on huge
+//    directories. Matches are collected unsorted into a geometrically
+//    growing array and sorted once at the end.
+
+#define EXPAND_DIRBUF_SIZE  (1 << 20)
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct matchlist {
+    char** v;
+    int n;
+    int capacity;
+} matchlist;
+
+
+// matchlist_append(ml, str)
+//    Add the dynamically-allocated string `str` to the end of `ml`.
+
+static void matchlist_append(matchlist* ml, char* str) {
+    if (ml->n == ml->capacity) {
+        ml->capacity = ml->capacity ? ml->capacity * 2 : 32;
+        ml->v = (char**) realloc(ml->v, sizeof(char*) * ml->capacity);
+    }
+    ml->v[ml->n] = str;
+    ++ml->n;
+}
+
+
+// expand_has_magic(word)
+//    Return 1 if `word` contains a glob metacharacter.
+
+int expand_has_magic(const char* word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+
+// match_bracket(p, ch, matched)
+//    Match `ch` against the bracket expression starting just after `[` at
+//    `p`. Sets `*matched` and returns a pointer just past the closing `]`,
+//    or NULL if the bracket is unterminated (then `[` is an ordinary
+//    character).
+
+static const char* match_bracket(const char* p, int ch, int* matched) {
+    int negate = (*p == '!' || *p == '^');
+    if (negate)
+        ++p;
+    int found = 0;
+    const char* start = p;
+    while (*p && (*p != ']' || p == start)) {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if ((unsigned char) p[0] <= ch && ch <= (unsigned char) p[2])
+                found = 1;
+            p += 3;
+        } else {
+            if ((unsigned char) *p == ch)
+                found = 1;
+            ++p;
+        }
+    }
+    if (*p != ']')
+        return NULL;
+    *matched = found != negate;
+    return p + 1;
+}
+
+
+// expand_match(pattern, name)
+//    Return 1 if `name` matches the glob `pattern`. `*` backtracks only to
+//    the most recent star, so matching is linear for typical patterns.
+
+int expand_match(const char* pattern, const char* name) {
+    const char* star_p = NULL;
+    const char* star_n = NULL;
+
+    while (*name) {
+        int matched;
+        const char* next;
+        if (*pattern == '*') {
+            star_p = ++pattern;
+            star_n = name;
+            continue;
+        } else if (*pattern == '?') {
+            ++pattern, ++name;
+            continue;
+        } else if (*pattern == '['
+                   && (next = match_bracket(pattern + 1, (unsigned char) *name,
+                                            &matched)) != NULL) {
+            if (matched) {
+                pattern = next, ++name;
+                continue;
+            }
+        } else if (*pattern == *name) {
+            ++pattern, ++name;
+            continue;
+        }
+
+        // mismatch: let the last `*` swallow one more character
+        if (!star_p)
+            return 0;
+        pattern = star_p;
+        name = ++star_n;
+    }
+
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == '\0';
+}
+
+
+// join_path(dir, name)
+//    Return a newly allocated "dir/name" (or just "name" if `dir` is empty).
+
+static char* join_path(const char* dir, const char* name, size_t namelen) {
+    size_t dirlen = strlen(dir);
+    int slash = dirlen > 0 && dir[dirlen - 1] != '/';
+    char* path = (char*) malloc(dirlen + slash + namelen + 1);
+    memcpy(path, dir, dirlen);
+    if (slash)
+        path[dirlen] = '/';
+    memcpy(path + dirlen + slash, name, namelen);
+    path[dirlen + slash + namelen] = '\0';
+    return path;
+}
+
+
+// expand_dir(dir, pattern, ml)
+//    Expand the remaining path `pattern` (with no leading slash) relative to
+//    the directory `dir` ("" means the current directory), appending every
+//    matching path to `ml`.
+
+static void expand_dir(const char* dir, const char* pattern, matchlist* ml) {
+    // split off the first path component
+    const char* slash = strchr(pattern, '/');
+    size_t complen = slash ? (size_t) (slash - pattern) : strlen(pattern);
+    const char* rest = slash;
+    while (rest && *rest == '/')
+        ++rest;
+    char comp[complen + 1];
+    memcpy(comp, pattern, complen);
+    comp[complen] = '\0';
+
+    // a literal component just extends the path
+    if (!expand_has_magic(comp)) {
+        char* path = join_path(dir, comp, complen);
+        struct stat st;
+        if (rest && *rest)
+            expand_dir(path, rest, ml);
+        else if (lstat(path, &st) == 0) {
+            if (slash) {
+                // keep the trailing slash the pattern asked for
+                char* dirpath = join_path(path, "", 0);
+                free(path);
+                path = dirpath;
+            }
+            matchlist_append(ml, path);
+            return;
+        }
+        free(path);
+        return;
+    }
+
+    int fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    char* buf = (char*) malloc(EXPAND_DIRBUF_SIZE);
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, buf, EXPAND_DIRBUF_SIZE)) > 0) {
+        for (long off = 0; off < nread; ) {
+            struct linux_dirent64* d = (struct linux_dirent64*) (buf + off);
+            off += d->d_reclen;
+
+            // hidden files only match an explicit leading `.`
+            if (d->d_name[0] == '.' && comp[0] != '.')
+                continue;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+            if (!expand_match(comp, d->d_name))
+                continue;
+
+            if (slash) {
+                // more components follow, so only directories can match
+                if (d->d_type != DT_DIR && d->d_type != DT_LNK
+                    && d->d_type != DT_UNKNOWN)
+                    continue;
+                char* path = join_path(dir, d->d_name, strlen(d->d_name));
+                if (*rest)
+                    expand_dir(path, rest, ml);
+                else {
+                    struct stat st;
+                    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+                        matchlist_append(ml, join_path(path, "", 0));
+                }
+                free(path);
+            } else
+                matchlist_append(ml, join_path(dir, d->d_name,
+                                               strlen(d->d_name)));
+        }
+    }
+
+    free(buf);
+    close(fd);
+}
+
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+// expand_glob(pattern, matches)
+//    Expand `pattern` against the filesystem. Stores a newly allocated array
+//    of newly allocated, sorted paths in `*matches` and returns how many
+//    there are. Returns 0 (and stores NULL) if nothing matches.
+
+int expand_glob(const char* pattern, char*** matches) {
+    matchlist ml = { NULL, 0, 0 };
+
+    if (pattern[0] == '/') {
+        while (*pattern == '/')
+            ++pattern;
+        expand_dir("/", pattern, &ml);
+    } else
+        expand_dir("", pattern, &ml);
+
+    if (ml.n > 1)
+        qsort(ml.v, ml.n, sizeof(char*), compare_strings);
+    *matches = ml.v;
+    return ml.n;
+}
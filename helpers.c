@@ -32,6 +32,37 @@ static inline int isshellspecial(int ch) {
 }
 
 
+// parse_substitution(str, bstr)
+//    `str` points just past the `$(` of a command substitution. Append the
+//    substitution's body, unchanged and wrapped in SUBST_BEGIN/SUBST_END, to
+//    `bstr`, and return a pointer just past the matching `)`. Parentheses
+//    inside quotes don't count.
+
+static const char* parse_substitution(const char* str, buildstring* bstr) {
+    int depth = 1;
+    int quoted = 0;
+    buildstring_append(bstr, SUBST_BEGIN);
+    for (; *str; ++str) {
+        if ((*str == '\"' || *str == '\'') && !quoted)
+            quoted = *str;
+        else if (*str == quoted)
+            quoted = 0;
+        else if (*str == '\\' && str[1] != '\0' && quoted != '\'') {
+            buildstring_append(bstr, *str);
+            ++str;
+        } else if (*str == '(' && !quoted)
+            ++depth;
+        else if (*str == ')' && !quoted && --depth == 0) {
+            ++str;
+            break;
+        }
+        buildstring_append(bstr, *str);
+    }
+    buildstring_append(bstr, SUBST_END);
+    return str;
+}
+
+
 // parse_shell_token(str, type, token)
 //    Parse the next token from the shell command `str`. Stores the type of
 //    the token in `*type`; this is one of the TOKEN_ constants. Stores the
@@ -95,6 +126,10 @@ const char* parse_shell_token(const char* str, int* type, char** token) {
         while ((*str && quoted)
                || (*str && !isspace((unsigned char) *str)
                    && !isshellspecial((unsigned char) *str))) {
+            if (*str == '$' && str[1] == '(' && quoted != '\'') {
+                str = parse_substitution(str + 2, &buildtoken);
+                continue;
+            }
             if ((*str == '\"' || *str == '\'') && !quoted)
                 quoted = *str;
             else if (*str == quoted)
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include "sh61.h"
+#include <string.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Scheduling classes for jobs.
+//
+//    Every command is started under a scheduling policy: CPU scheduling
+//    class and nice value, I/O priority class, and optional resource
+//    limits. Foreground commands keep the shell's own priority; background
+//    (`&`) commands default to `batch,nice=10,io=idle`, so they get little
+//    CPU time while anything interactive wants it and disk time only when
+//    nothing else does. (Not SCHED_IDLE: on a busy single CPU that can keep
+//    a background job from even reaching exec.) The policy can be changed for
+//    the whole shell with `--bg=SPEC`, and any single command can be given
+//    its own with an `@SPEC` prefix word, e.g. `@normal make &`.
+//
+//    SPEC is a comma-separated list of:
+//       normal                  shell's own priority: no class changes, nice 0
+//       batch | idle            CPU class (idle also means idle I/O)
+//       nice=N                  nice increment
+//       io=be | idle            I/O class
+//       cpu=SECONDS             RLIMIT_CPU
+//       mem=BYTES[kKmMgG]       RLIMIT_AS
+
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_BE_NORM      4       // best-effort level matching nice 0
+
+#define BACKGROUND_DEFAULT \
+    { POLICY_CPU_BATCH, 10, POLICY_IO_IDLE, RLIM_INFINITY, RLIM_INFINITY }
+
+sched_policy background_policy = BACKGROUND_DEFAULT;
+
+sched_policy foreground_policy = {
+    POLICY_CPU_DEFAULT, 0, POLICY_IO_DEFAULT, RLIM_INFINITY, RLIM_INFINITY
+};
+
+
+// parse_size(str, size)
+//    Parse a number with an optional k/m/g suffix. Returns 1 on success.
+
+static int parse_size(const char* str, unsigned long long* size) {
+    char* end;
+    *size = strtoull(str, &end, 10);
+    if (end == str)
+        return 0;
+    switch (*end) {
+    case 'k': case 'K': *size <<= 10; ++end; break;
+    case 'm': case 'M': *size <<= 20; ++end; break;
+    case 'g': case 'G': *size <<= 30; ++end; break;
+    }
+    return *end == '\0';
+}
+
+
+// policy_parse(spec, p)
+//    Parse the policy specification `spec` into `*p`, starting from the
+//    policy already in `*p`. Returns 0 on success, -1 if `spec` is invalid
+//    (then `*p` may be partly changed).
+
+int policy_parse(const char* spec, sched_policy* p) {
+    char buf[BUFSIZ];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    char* saveptr;
+    for (char* item = strtok_r(buf, ",", &saveptr); item;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        unsigned long long n;
+        if (strcmp(item, "normal") == 0) {
+            p->cpu = POLICY_CPU_DEFAULT;
+            p->nice = 0;
+            p->io = POLICY_IO_DEFAULT;
+        } else if (strcmp(item, "batch") == 0)
+            p->cpu = POLICY_CPU_BATCH;
+        else if (strcmp(item, "idle") == 0) {
+            p->cpu = POLICY_CPU_IDLE;
+            p->io = POLICY_IO_IDLE;
+        } else if (strncmp(item, "nice=", 5) == 0) {
+            char* end;
+            p->nice = strtol(item + 5, &end, 10);
+            if (end == item + 5 || *end)
+                return -1;
+        } else if (strcmp(item, "io=be") == 0)
+            p->io = POLICY_IO_BE;
+        else if (strcmp(item, "io=idle") == 0)
+            p->io = POLICY_IO_IDLE;
+        else if (strncmp(item, "cpu=", 4) == 0 && parse_size(item + 4, &n))
+            p->cpu_limit = n;
+        else if (strncmp(item, "mem=", 4) == 0 && parse_size(item + 4, &n))
+            p->mem_limit = n;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+
+// policy_reset()
+//    Restore `background_policy` to the default a new shell starts with.
+
+void policy_reset(void) {
+    static const sched_policy initial = BACKGROUND_DEFAULT;
+    background_policy = initial;
+}
+
+
+// policy_apply(p)
+//    Put the calling process (a child about to exec) under policy `p`.
+//    Failures are ignored: a job that can't be deprioritized still runs.
+
+void policy_apply(const sched_policy* p) {
+    struct sched_param param = { 0 };
+    if (p->cpu == POLICY_CPU_BATCH)
+        sched_setscheduler(0, SCHED_BATCH, &param);
+    else if (p->cpu == POLICY_CPU_IDLE)
+        sched_setscheduler(0, SCHED_IDLE, &param);
+
+    if (p->nice)
+        setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + p->nice);
+
+    if (p->io != POLICY_IO_DEFAULT)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                (p->io << IOPRIO_CLASS_SHIFT)
+                | (p->io == POLICY_IO_BE ? IOPRIO_BE_NORM : 0));
+
+    struct rlimit rl;
+    if (p->cpu_limit != RLIM_INFINITY) {
+        rl.rlim_cur = rl.rlim_max = p->cpu_limit;
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (p->mem_limit != RLIM_INFINITY) {
+        rl.rlim_cur = rl.rlim_max = p->mem_limit;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+}
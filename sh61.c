@@ -3,12 +3,33 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <stdio_ext.h>
+#include <limits.h>
 
 
 sig_atomic_t sig_received = 0;
 
 pid_t foreground = 0;
 
+// split oversized expanded argument lists into several executions (-b)
+int batch_args = 0;
+
+// exit status of the last command run by run_list
+int last_status = 0;
+
+// print each command list after optimization (--explain)
+int explain_plan = 0;
+
+extern char** environ;
+
+void eval_line(const char* s);
+static struct command* parse_line(const char* s);
+static void eval_list(struct command* start);
+static void command_expand(struct command* c);
+static FILE* open_script(int argc, char* argv[], int* quiet);
+static void run_script(FILE* command_file, int quiet);
+static int compile_script(const char* source, const char* output);
+
 // struct command
 //    Data structure describing a command. Add your own stuff.
 
@@ -18,6 +39,9 @@ typedef struct redirect redirect;
 struct command {
     int argc;      // number of arguments
     char** argv;   // arguments, terminated by NULL
+    int capacity;  // number of slots allocated in argv
+    int expand_first;  // first argument of the largest pathname expansion, -1 if none
+    int expand_last;   // last argument of that expansion
     pid_t pid;     // process ID running this command, -1 if none
     int bg;        // background job? 
     int status;     // store status of waitpid
@@ -25,6 +49,11 @@ struct command {
     command* prev;  // the previous command
     int condition_type;  // the type of the next condition
     redirect* redirection; // pointer to redirection linked list
+    int echo_to_pipe;  // `echo` whose output the shell writes into the pipe
+    int has_policy;    // set by an `@SPEC` prefix?
+    sched_policy policy;   // scheduling policy from the `@SPEC` prefix
+    int borrowed;      // struct, argv and words belong to a compiled script
+    int dynamic;       // words or redirections to expand when it runs?
 };
 
 /*
@@ -34,6 +63,7 @@ struct redirect {
     char* token;    // the token
     char* file;     // the file to redirect to/from
     redirect* next; // the next redirect node
+    int borrowed;   // belongs to a compiled script, like the strings
 };
 
 
@@ -44,12 +74,20 @@ static command* command_alloc(void) {
     command* c = (command*) malloc(sizeof(command));
     c->argc = 0;
     c->argv = NULL;
+    c->capacity = 0;
+    c->expand_first = -1;
+    c->expand_last = -1;
     c->pid = -1;
     c->next = NULL;
     c->prev = NULL;
     c->bg = 0;
     c->condition_type = -2;
     c->redirection = NULL;
+    c->echo_to_pipe = 0;
+    c->has_policy = 0;
+    c->status = 0;
+    c->borrowed = 0;
+    c->dynamic = 0;
     return c;
 }
 
@@ -58,6 +96,7 @@ static command* command_alloc(void) {
 static redirect* redirect_alloc(void) {
     redirect* red = (redirect*) malloc(sizeof(redirect));
     red->next = NULL;
+    red->borrowed = 0;
     return red;
 }
 
@@ -68,23 +107,31 @@ void handler(void) {
 
 // command_free(c)
 //    Free the linked list command structure `c`, including all its words, 
-//    and redirection sublists
+//    and redirection sublists. Borrowed commands and redirections (from a
+//    compiled script) are left alone, but redirections the optimizer added
+//    to them are freed.
 
 static void command_free(command* c) {
     
     command* trav = c;
     while (c != NULL) {
-        for (int i = 0; i != c->argc; ++i)
-            free(c->argv[i]);
         redirect* red;
         while(c->redirection != NULL) {
             red = c->redirection->next;
-            free(c->redirection);
+            if (!c->redirection->borrowed) {
+                free(c->redirection->token);
+                free(c->redirection->file);
+                free(c->redirection);
+            }
             c->redirection = red;
         }
         trav = c->next;
-        free(c->argv);
-        free(c);
+        if (!c->borrowed) {
+            for (int i = 0; i != c->argc; ++i)
+                free(c->argv[i]);
+            free(c->argv);
+            free(c);
+        }
         c = trav;
     }
 }
@@ -92,16 +139,508 @@ static void command_free(command* c) {
 
 // command_append_arg(c, word)
 //    Add `word` as an argument to command `c`. This increments `c->argc`
-//    and augments `c->argv`.
+//    and augments `c->argv`, doubling its capacity when it fills so long
+//    expanded argument lists are built in amortized constant time.
 
 static void command_append_arg(command* c, char* word) {
-    c->argv = (char**) realloc(c->argv, sizeof(char*) * (c->argc + 2));
+    if (c->argc + 2 > c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 8;
+        c->argv = (char**) realloc(c->argv, sizeof(char*) * c->capacity);
+    }
     c->argv[c->argc] = word;
     c->argv[c->argc + 1] = NULL;
     ++c->argc;
 }
 
 
+// child_exit(status)
+//    Exit a forked child that did not exec. Uses `_exit` because `exit`
+//    would also flush the script file's stream, moving the file offset the
+//    child shares with the shell back to an earlier line.
+
+static void child_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    trace_flush();
+    _exit(status);
+}
+
+
+// args_size(argv, n)
+//    Return the space `n` arguments from `argv` take up in a new process
+//    image: the strings plus their pointers.
+
+static size_t args_size(char** argv, int n) {
+    size_t size = 0;
+    for (int i = 0; i < n; ++i)
+        size += strlen(argv[i]) + 1 + sizeof(char*);
+    return size;
+}
+
+
+// command_path(name, path, size)
+//    Resolve the command `name` through PATH the way `execvp` would, storing
+//    the result in `path`. Returns 1 on success, 0 if no executable is found.
+
+static int command_path(const char* name, char* path, size_t size) {
+    if (strchr(name, '/')) {
+        snprintf(path, size, "%s", name);
+        return access(path, X_OK) == 0;
+    }
+
+    const char* dirs = getenv("PATH");
+    if (!dirs)
+        dirs = "/bin:/usr/bin";
+    while (*dirs) {
+        size_t len = strcspn(dirs, ":");
+        snprintf(path, size, "%.*s%s%s", (int) len, dirs, len ? "/" : "", name);
+        if (access(path, X_OK) == 0)
+            return 1;
+        dirs += len + (dirs[len] == ':');
+    }
+    return 0;
+}
+
+
+// is_program(name, program)
+//    Return 1 if the command `name` resolves to the file `program`.
+
+static int is_program(const char* name, const char* program) {
+    char path[BUFSIZ];
+    struct stat self, st;
+    return command_path(name, path, sizeof(path))
+        && stat(program, &self) == 0
+        && stat(path, &st) == 0
+        && self.st_dev == st.st_dev && self.st_ino == st.st_ino;
+}
+
+
+// is_self(name)
+//    Return 1 if the command `name` is this sh61 binary.
+
+static int is_self(const char* name) {
+    return is_program(name, "/proc/self/exe");
+}
+
+
+// sh_script_supported(str)
+//    Return 1 if `sh -c str` would mean exactly the same thing to sh61:
+//    no expansions, subshells, here-documents or fd duplication, no `#`
+//    (sh61 starts a comment at any `#`, sh only at the start of a word),
+//    only the `>`, `<` and `2>` redirections, no shell keywords, builtins
+//    or variable assignments in command position, and no pipeline after
+//    `&&` or `||` (run_list would skip only its first command).
+
+static int sh_script_supported(const char* str) {
+    static const char* const unsupported[] = {
+        "if", "then", "else", "elif", "fi", "for", "while", "until", "do",
+        "done", "case", "esac", "function", "!", "[[", "exit", "export",
+        "set", "unset", "read", "wait", "source", ".", "exec", "eval",
+        "trap", "shift", "return", "local", "alias", "ulimit", "umask",
+        "readonly", "times", "type", "command", "builtin", NULL
+    };
+    int type;
+    char* token;
+    int first = 1;
+    int conditional = 0;    // command follows `&&` or `||`
+
+    if (strpbrk(str, "$`\\(){}~#\n"))
+        return 0;
+
+    while ((str = parse_shell_token(str, &type, &token)) != NULL) {
+        int ok = 1;
+        if (type == TOKEN_REDIRECTION) {
+            ok = strcmp(token, ">") == 0 || strcmp(token, "<") == 0
+                || strcmp(token, "2>") == 0;
+            free(token);
+            str = parse_shell_token(str, &type, &token);
+            ok = ok && str != NULL && type == TOKEN_NORMAL;
+        } else if (type == TOKEN_NORMAL) {
+            for (int i = 0; first && unsupported[i]; ++i)
+                if (strcmp(token, unsupported[i]) == 0)
+                    ok = 0;
+            if (first && strchr(token, '='))
+                ok = 0;
+            first = 0;
+        } else if (type == TOKEN_OTHER || type == TOKEN_LPAREN
+                   || type == TOKEN_RPAREN)
+            ok = 0;
+        else {
+            if (type == TOKEN_PIPE)
+                ok = !conditional;
+            else
+                conditional = type == TOKEN_AND || type == TOKEN_OR;
+            first = 1;
+        }
+        free(token);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+
+// command_inline(c)
+//    If `c` only starts another interpreter to parse and run more commands
+//    -- sh61 itself, or the system `sh -c` with a script sh61 runs the
+//    same way -- run those commands in this already-forked child instead,
+//    saving the exec and interpreter startup, then exit. Returns if `c`
+//    must be exec'ed after all.
+
+static void command_inline(command* c) {
+    const char* base = strrchr(c->argv[0], '/');
+    base = base ? base + 1 : c->argv[0];
+
+    if (strcmp(base, "sh") == 0 && c->argc == 3
+        && strcmp(c->argv[1], "-c") == 0
+        && sh_script_supported(c->argv[2])
+        && is_program(c->argv[0], "/bin/sh")) {
+        // exec would have discarded output the shell had not flushed yet
+        __fpurge(stdout);
+        last_status = 0;
+        eval_line(c->argv[2]);
+        child_exit(last_status);
+    }
+
+    if (strcmp(base, "sh61") == 0 && is_self(c->argv[0])) {
+        __fpurge(stdout);
+        // start from the options and status a freshly exec'ed sh61 has
+        explain_plan = 0;
+        batch_args = 0;
+        policy_reset();
+        last_status = 0;
+        int quiet;
+        FILE* command_file = open_script(c->argc, c->argv, &quiet);
+        // don't reuse input the parent shell had buffered from stdin
+        if (command_file == stdin)
+            command_file = fdopen(STDIN_FILENO, "rb");
+        run_script(command_file, quiet);
+        child_exit(0);
+    }
+}
+
+
+// command_exec(c)
+//    Replace the current process with command `c`. Returns only if the exec
+//    fails.
+//
+//    With argument batching on (`-b`), if `c`'s expanded arguments would
+//    not fit in ARG_MAX, run it several times instead, xargs-style: each
+//    run gets the arguments before and after the largest expansion (words
+//    from any other glob included) plus as many of its arguments as fit.
+//    Exits with the last failing status.
+
+static void command_exec(command* c) {
+    // background jobs get a lower priority unless the command says otherwise
+    if (c->has_policy)
+        policy_apply(&c->policy);
+    else
+        policy_apply(c->bg ? &background_policy : &foreground_policy);
+
+    command_inline(c);
+
+    long limit = sysconf(_SC_ARG_MAX) - 2048;
+    for (char** e = environ; *e; ++e)
+        limit -= strlen(*e) + 1 + sizeof(char*);
+
+    if (!batch_args || c->expand_first < 0
+        || (long) args_size(c->argv, c->argc) <= limit) {
+        execvp(c->argv[0], c->argv);
+        return;
+    }
+
+    // the fixed arguments appear in every batch
+    limit -= args_size(c->argv, c->expand_first);
+    limit -= args_size(c->argv + c->expand_last + 1,
+                       c->argc - c->expand_last - 1);
+    char** batch = (char**) malloc(sizeof(char*) * (c->argc + 1));
+    memcpy(batch, c->argv, sizeof(char*) * c->expand_first);
+
+    int exit_status = 0;
+    int i = c->expand_first;
+    while (i <= c->expand_last) {
+        // take as many expanded arguments as fit, but at least one
+        int n = c->expand_first;
+        long used = 0;
+        do {
+            used += strlen(c->argv[i]) + 1 + sizeof(char*);
+            batch[n++] = c->argv[i++];
+        } while (i <= c->expand_last
+                 && used + (long) (strlen(c->argv[i]) + 1 + sizeof(char*)) <= limit);
+        for (int j = c->expand_last + 1; j < c->argc; ++j)
+            batch[n++] = c->argv[j];
+        batch[n] = NULL;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp(batch[0], batch);
+            printf("%s: %s\n", batch[0], strerror(errno));
+            child_exit(1);
+        }
+        int status = 0;
+        if (pid == -1 || waitpid(pid, &status, 0) < 0)
+            exit_status = 1;
+        else if (WEXITSTATUS(status) != 0)
+            exit_status = WEXITSTATUS(status);
+    }
+    child_exit(exit_status);
+}
+
+
+// trace_exec(c)
+//    In a child about to exec `c`, open its exec-to-exit span on the
+//    child's own track and write it out before the buffer is lost to exec.
+
+static void trace_exec(command* c) {
+    if (trace_enabled) {
+        char args[32];
+        snprintf(args, sizeof(args), "\"argc\":%d", c->argc);
+        trace_begin(c->argv[0], getpid(), args);
+        trace_flush();
+    }
+}
+
+
+// trace_fork(start, pid)
+//    In the shell, record the span spent forking child `pid`.
+
+static void trace_fork(unsigned long long start, pid_t pid) {
+    if (trace_enabled) {
+        char args[32];
+        snprintf(args, sizeof(args), "\"child\":%d", pid);
+        trace_span("fork", start, args);
+    }
+}
+
+
+// trace_condition(c, run)
+//    Record the decision made by `c`'s `&&` or `||`: whether the next
+//    command is run or skipped.
+
+static void trace_condition(command* c, int run) {
+    if (trace_enabled) {
+        char args[48];
+        snprintf(args, sizeof(args), "\"status\":%d,\"next\":\"%s\"",
+                 WEXITSTATUS(c->status), run ? "run" : "skip");
+        trace_instant(c->condition_type == TOKEN_AND ? "&&" : "||", args);
+    }
+}
+
+
+// OPTIMIZATION
+
+// is_plain(c, name, argc)
+//    Return 1 if `c` runs `name` with exactly `argc` words, none left to
+//    expand, and no redirections.
+
+static int is_plain(command* c, const char* name, int argc) {
+    return c->argc == argc && c->redirection == NULL && !c->dynamic
+        && strcmp(c->argv[0], name) == 0;
+}
+
+
+// has_redirect(c, token)
+//    Return 1 if `c` has a `token` redirection.
+
+static int has_redirect(command* c, const char* token) {
+    for (redirect* red = c->redirection; red; red = red->next)
+        if (strcmp(red->token, token) == 0)
+            return 1;
+    return 0;
+}
+
+
+// echo_length(c)
+//    Return the number of bytes `echo` would print for `c`.
+
+static size_t echo_length(command* c) {
+    size_t len = 1;
+    for (int i = 1; i < c->argc; ++i)
+        len += strlen(c->argv[i]) + (i > 1);
+    return len;
+}
+
+
+// echo_to_fd(c, fd)
+//    Write what the `echo` command `c` would print to `fd`.
+
+static void echo_to_fd(command* c, int fd) {
+    char buf[PIPE_BUF];
+    size_t len = 0;
+    for (int i = 1; i < c->argc; ++i) {
+        if (i > 1)
+            buf[len++] = ' ';
+        memcpy(buf + len, c->argv[i], strlen(c->argv[i]));
+        len += strlen(c->argv[i]);
+    }
+    buf[len++] = '\n';
+    write(fd, buf, len);
+}
+
+
+// unlink_command(pp)
+//    Remove the command `*pp` from its list and free it.
+
+static void unlink_command(command** pp) {
+    command* c = *pp;
+    if (c->next && c->next->prev == c)
+        c->next->prev = c->prev;
+    *pp = c->next;
+    c->next = NULL;
+    command_free(c);
+}
+
+
+// optimize_list(c, folded_status)
+//    Rewrite the command list `c` to spawn fewer processes, and return the
+//    new list (which may be empty). If a rewrite removes the command whose
+//    status the list would have left, that status is stored in
+//    `*folded_status` (otherwise that is unchanged). Each rewrite leaves what run_list does
+//    unchanged, including its `&&` / `||` rule of skipping exactly one
+//    command, so none is applied to a command that a `&&` or `||` could
+//    skip:
+//
+//    - `cat file | cmd` becomes `cmd < file` (if `file` is readable and
+//      `cmd` has no input redirection).
+//    - `cmd | cat` becomes `cmd` if our stdout isn't a terminal, which is
+//      all `cat` would change (unless `&&` or `||` tests cat's status; at
+//      the end of the list, cat's status 0 is kept).
+//    - `true && x`, `false || x` become `x`; `true || x`, `false && x`
+//      drop `x`.
+//    - `echo words | cmd` is marked so the shell writes the words into the
+//      pipe itself instead of forking `echo`.
+
+static command* optimize_list(command* c, int* folded_status) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        command** pp = &c;
+        command* before = NULL;     // command before *pp
+        int entry = TOKEN_SEQUENCE;         // operator before *pp
+        int before_entry = TOKEN_SEQUENCE;  // operator before `before`
+
+        while (*pp) {
+            command* cmd = *pp;
+            int skippable = entry == TOKEN_AND || entry == TOKEN_OR;
+
+            // cat file | cmd  =>  cmd < file
+            if (!skippable && entry != TOKEN_PIPE
+                && cmd->condition_type == TOKEN_PIPE
+                && is_plain(cmd, "cat", 2) && cmd->argv[1][0] != '-'
+                && !has_redirect(cmd->next, "<")
+                && access(cmd->argv[1], R_OK) == 0) {
+                redirect* red = redirect_alloc();
+                red->token = strdup("<");
+                red->file = cmd->borrowed ? strdup(cmd->argv[1]) : cmd->argv[1];
+                red->next = cmd->next->redirection;
+                cmd->next->redirection = red;
+                cmd->argv[1] = NULL;
+                --cmd->argc;
+                unlink_command(pp);
+                changed = 1;
+                continue;
+            }
+
+            // cmd | cat  =>  cmd
+            if (entry == TOKEN_PIPE && before_entry != TOKEN_AND
+                && before_entry != TOKEN_OR && is_plain(cmd, "cat", 1)
+                && cmd->condition_type != TOKEN_PIPE
+                && cmd->condition_type != TOKEN_AND
+                && cmd->condition_type != TOKEN_OR
+                && !isatty(STDOUT_FILENO)) {
+                if (!cmd->next && !cmd->bg)
+                    *folded_status = 0;
+                before->condition_type = cmd->condition_type;
+                before->bg = cmd->bg;
+                unlink_command(pp);
+                changed = 1;
+                continue;
+            }
+
+            // constant conditionals
+            if (!skippable && entry != TOKEN_PIPE && cmd->next
+                && (cmd->condition_type == TOKEN_AND
+                    || cmd->condition_type == TOKEN_OR)
+                && (is_plain(cmd, "true", 1) || is_plain(cmd, "false", 1))) {
+                int succeeds = cmd->argv[0][0] == 't';
+                int runs_next = (cmd->condition_type == TOKEN_AND) == succeeds;
+                unlink_command(pp);
+                if (!runs_next) {
+                    // nothing left to run will set the status `cmd` would have
+                    if (!(*pp)->next && !(*pp)->bg)
+                        *folded_status = !succeeds;
+                    unlink_command(pp);
+                }
+                changed = 1;
+                continue;
+            }
+
+            // echo words | cmd: no fork for echo
+            if (entry != TOKEN_PIPE && !cmd->echo_to_pipe
+                && cmd->condition_type == TOKEN_PIPE && cmd->argc > 0
+                && !cmd->dynamic && strcmp(cmd->argv[0], "echo") == 0
+                && cmd->redirection == NULL
+                && (cmd->argc == 1 || cmd->argv[1][0] != '-')
+                && echo_length(cmd) <= PIPE_BUF)
+                cmd->echo_to_pipe = 1;
+
+            before_entry = entry;
+            entry = cmd->condition_type;
+            before = cmd;
+            pp = &cmd->next;
+        }
+    }
+    return c;
+}
+
+
+// explain_word(word)
+//    Print the parsed word `word` to stderr, with words still to be
+//    expanded shown as they were written.
+
+static void explain_word(const char* word) {
+    if (*word == WORD_EXPAND || *word == WORD_EXPAND_QUOTED)
+        ++word;
+    int quote = strpbrk(word, " \t|&;<>") != NULL;
+    fprintf(stderr, quote ? " '" : " ");
+    for (; *word; ++word)
+        if (*word == SUBST_BEGIN)
+            fprintf(stderr, "$(");
+        else if (*word == SUBST_END)
+            fprintf(stderr, ")");
+        else
+            fputc(*word, stderr);
+    if (quote)
+        fputc('\'', stderr);
+}
+
+
+// explain_list(c)
+//    Print the command list `c` to stderr as sh61 will run it.
+
+static void explain_list(command* c) {
+    fprintf(stderr, "sh61: plan:");
+    for (; c; c = c->next) {
+        if (c->echo_to_pipe)
+            fprintf(stderr, " [builtin]");
+        for (int i = 0; i < c->argc; ++i)
+            explain_word(c->argv[i]);
+        for (redirect* red = c->redirection; red; red = red->next) {
+            fprintf(stderr, " %s", red->token);
+            explain_word(red->file ? red->file : "");
+        }
+        switch (c->condition_type) {
+        case TOKEN_SEQUENCE:   fprintf(stderr, " ;");  break;
+        case TOKEN_BACKGROUND: fprintf(stderr, " &");  break;
+        case TOKEN_PIPE:       fprintf(stderr, " |");  break;
+        case TOKEN_AND:        fprintf(stderr, " &&"); break;
+        case TOKEN_OR:         fprintf(stderr, " ||"); break;
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+
 // COMMAND EVALUATION
 
 // start_command(c, pgid)
@@ -122,12 +661,21 @@ pid_t start_command(command* c, pid_t pgid) {
     (void) pgid;
     // Your code here!
     
+    // expand words now that the command (or pipeline) is really running
+    for (command* stage = c; stage; stage = stage->next) {
+        command_expand(stage);
+        if (stage->condition_type != TOKEN_PIPE)
+            break;
+    }
+    
 /*    if (sig_received == 1)*/
 /*        exit(0);*/
     
     // if command is a redirect
-    if (strcmp(c->argv[0], "cd") == 0) {
+    if (c->argc > 0 && strcmp(c->argv[0], "cd") == 0) {
+        unsigned long long cd_start = trace_now();
         c->status = chdir(c->argv[1]);
+        trace_span("cd", cd_start, NULL);
         return 0;
     }
     
@@ -143,8 +691,11 @@ pid_t start_command(command* c, pid_t pgid) {
         setpgid(foreground, foreground);
     }
     
-    // if there is no command to run
-    if (c->argv == NULL)
+    // if there is no command to run. A pipeline stage or redirection whose
+    // words all expanded to nothing still runs, as a child that only
+    // does its redirections.
+    if (c->argc == 0 && c->condition_type != TOKEN_PIPE
+        && c->redirection == NULL)
         return c->pid;
     
     // install the signal handler
@@ -162,6 +713,9 @@ pid_t start_command(command* c, pid_t pgid) {
     // initialize the number of pipes we need to create to zero
     int pipes = 0;
     
+    // start time of the current fork, for tracing
+    unsigned long long fork_start;
+    
     // create a command pointer to traverse command list
     command* trav = c; 
    
@@ -181,8 +735,17 @@ pid_t start_command(command* c, pid_t pgid) {
         for (int i = 0; i < pipes; i++) {
             pipe(pipefd[i]);
             
+            // an `echo` feeding the pipe is written by the shell itself
+            fork_start = trace_now();
+            if (c->echo_to_pipe) {
+                echo_to_fd(c, pipefd[i][1]);
+                c->pid = 0;
+            }
+            
             // fork the write end of the pipe
-            if ((c->pid = fork()) == 0) {
+            else if ((c->pid = fork()) == 0) {
+                trace_after_fork();
+                
                 // if there are any redirections
                 red = c->redirection;
                 while(red != NULL) {
@@ -224,19 +787,25 @@ pid_t start_command(command* c, pid_t pgid) {
                 dup2(pipefd[i][1], STDOUT_FILENO);
                 close(pipefd[i][1]);
                 
+                // an empty stage does nothing more
+                if (c->argc == 0)
+                    child_exit(0);
+                
                 // run the command, checking for errors
-                if (execvp(c->argv[0], c->argv) < 0) {
-                    printf("%s: command not found. \n", c->argv[0]);
-                    exit(0);
-                }
+                trace_exec(c);
+                command_exec(c);
+                printf("%s: command not found. \n", c->argv[0]);
+                exit(0);
             }
             
             // if there was an error with fork
-            else if (c->pid == -1) {
+            if (c->pid == -1) {
                 printf("error with fork: start_command");
             }
             
             else {
+                if (c->pid > 0)
+                    trace_fork(fork_start, c->pid);
                 
                 // create the read end of the pipe
                 close(pipefd[i][1]);
@@ -250,12 +819,18 @@ pid_t start_command(command* c, pid_t pgid) {
         }
     }
     
+    // name of the last process, for messages
+    const char* name = c->argc > 0 ? c->argv[0] : "";
+    
     // fork the last process in the pipe, or if not a pipe fork the process   
+    fork_start = trace_now();
     c->pid = fork();
     
     // if child or parent
     switch(c->pid) {
         case 0: // child
+            trace_after_fork();
+            
             // handle any redirects
             red = c->redirection;
             while(red != NULL) {
@@ -304,21 +879,27 @@ pid_t start_command(command* c, pid_t pgid) {
                 red = red->next;
             }
             
+            // an empty command does nothing more
+            if (c->argc == 0)
+                child_exit(0);
+            
             // run the command, checking for errors            
-            if (execvp(c->argv[0], c->argv) == -1) {
-	            //printf(": command not found \n");
-            }
+            trace_exec(c);
+            command_exec(c);
+	        //printf(": command not found \n");
             break;
         
         // if fork was unsuccesfull
         case -1:
-            printf("fork failure: %d, %s\n", c->pid, *c->argv);
+            printf("fork failure: %d, %s\n", c->pid, name);
             break;
         
         // wait for child in parent process, checking for errors
         default:
+            trace_fork(fork_start, c->pid);
             if(waitpid(c->pid, &status, 0) < 0)
-                printf("waitfd: waitpid error: %s: process: %i", c->argv[0], c->pid);
+                printf("waitfd: waitpid error: %s: process: %i", name, c->pid);
+            trace_end(name, c->pid);
     }
     
     // close all the pipes
@@ -369,7 +950,10 @@ void run_list(command* c) {
         else if (c->bg == 1) {
             
             // fork the process
+            unsigned long long fork_start = trace_now();
             if ((pid = fork()) == 0) {
+                trace_after_fork();
+                
                 // while there are background commands to be run
                 while(c != NULL) {
                     // start the command
@@ -380,10 +964,13 @@ void run_list(command* c) {
                     while (c->condition_type == TOKEN_PIPE) {
                         c=c->next;
                     }   
+                    last_status = WEXITSTATUS(c->status);
                     
                     // if commands were &&'d together
                     if (c->condition_type == TOKEN_AND) {
                         
+                        trace_condition(c, WEXITSTATUS(c->status) == 0);
+                        
                         // if exit status is zero   
                         if (WEXITSTATUS(c->status) == 0)
                             // go to next command
@@ -397,6 +984,8 @@ void run_list(command* c) {
                     
                     // if commands were ||'d together 
                     else if (c->condition_type == TOKEN_OR) {
+                        trace_condition(c, WEXITSTATUS(c->status) != 0);
+                        
                         // if exit status is not zero go to next command
                          if (WEXITSTATUS(c->status) != 0)
                             c = c->next;
@@ -407,13 +996,15 @@ void run_list(command* c) {
                          }
                      }
                     
-                    // otherwise go to next command and return because 
-                    // we've reached the end of the background command sequence
-                    else {
-                        c = c->next;
-                        return;
-                    }
+                    // otherwise we've reached the end of the background
+                    // command sequence
+                    else
+                        break;
                 }
+                
+                // exit rather than return, or this subshell would go on
+                // reading the rest of the script as a second shell
+                child_exit(last_status);
             }
             
             // if there was a fork error
@@ -422,6 +1013,7 @@ void run_list(command* c) {
             // otherwise in parent find last command in background sequence
             // note: we don't wait so it will run in background
             else {
+                trace_fork(fork_start, pid);
                 while(c->condition_type != TOKEN_BACKGROUND) 
                     c=c->next;
                 // then increment one past it
@@ -438,9 +1030,12 @@ void run_list(command* c) {
             while (c->condition_type == TOKEN_PIPE) {
                 c=c->next;
             }
+            last_status = WEXITSTATUS(c->status);
             
             // if commands were &&'d together
             if (c->condition_type == TOKEN_AND) {
+                trace_condition(c, WEXITSTATUS(c->status) == 0);
+                
                 // if exit status is zero, go to next command
                 if (WEXITSTATUS(c->status) == 0)
                     c = c->next;
@@ -454,6 +1049,8 @@ void run_list(command* c) {
             
             // if commands were ||'d together
             else if (c->condition_type == TOKEN_OR) {
+                trace_condition(c, WEXITSTATUS(c->status) != 0);
+                
                 // if exit status is not zero, go to next command
                 if (WEXITSTATUS(c->status) != 0)
                     c = c->next;
@@ -476,14 +1073,295 @@ void run_list(command* c) {
 
 
 
-// eval_line(c)
-//    Parse the command list in `s` and run it via `run_list`.
+// COMMAND SUBSTITUTION
 
-void eval_line(const char* s) {
+typedef struct capture {
+    char* s;            // captured bytes (not NUL-terminated)
+    size_t length;
+    size_t capacity;
+} capture;
+
+
+// capture_reserve(cap, n)
+//    Make room for at least `n` more bytes in `cap`, doubling its capacity
+//    as needed.
+
+static void capture_reserve(capture* cap, size_t n) {
+    if (cap->length + n > cap->capacity) {
+        size_t capacity = cap->capacity ? cap->capacity : 4096;
+        while (cap->length + n > capacity)
+            capacity *= 2;
+        cap->s = (char*) realloc(cap->s, capacity);
+        cap->capacity = capacity;
+    }
+}
+
+
+// capture_append(cap, data, n)
+//    Append `n` bytes from `data` to `cap`.
+
+static void capture_append(capture* cap, const char* data, size_t n) {
+    capture_reserve(cap, n);
+    memcpy(cap->s + cap->length, data, n);
+    cap->length += n;
+}
+
+
+// substitute_builtin(c, cap)
+//    If `c` is a lone `echo` or `pwd`, append what it would print to `cap`
+//    without forking and return 1. Otherwise return 0.
+
+static int substitute_builtin(command* c, capture* cap) {
+    if (c->next || c->redirection || c->argc == 0 || c->dynamic)
+        return 0;
+
+    if (strcmp(c->argv[0], "echo") == 0
+        && (c->argc == 1 || c->argv[1][0] != '-')) {
+        for (int i = 1; i < c->argc; ++i) {
+            if (i > 1)
+                capture_append(cap, " ", 1);
+            capture_append(cap, c->argv[i], strlen(c->argv[i]));
+        }
+        capture_append(cap, "\n", 1);
+        return 1;
+    }
+
+    if (strcmp(c->argv[0], "pwd") == 0 && c->argc == 1) {
+        char* cwd = getcwd(NULL, 0);
+        if (!cwd)
+            return 0;
+        capture_append(cap, cwd, strlen(cwd));
+        capture_append(cap, "\n", 1);
+        free(cwd);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// substitute(body, cap)
+//    Run the command list `body` and append its standard output to `cap`.
+//    The output is read straight from a pipe into `cap`.
+
+static void substitute(const char* body, capture* cap) {
+    unsigned long long subst_start = trace_now();
+    command* c = parse_line(body);
+    int pipefd[2];
+
+    if (c->argc && !substitute_builtin(c, cap) && pipe(pipefd) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_after_fork();
+            // don't let the shell's unflushed output end up in the capture
+            __fpurge(stdout);
+            close(pipefd[0]);
+            dup2(pipefd[1], STDOUT_FILENO);
+            close(pipefd[1]);
+            last_status = 0;
+            eval_list(c);
+            child_exit(last_status);
+        }
+        close(pipefd[1]);
+
+        ssize_t n;
+        do {
+            capture_reserve(cap, 65536);
+            n = read(pipefd[0], cap->s + cap->length, cap->capacity - cap->length);
+            if (n > 0)
+                cap->length += n;
+        } while (n > 0 || (n == -1 && errno == EINTR));
+        close(pipefd[0]);
+
+        int status;
+        if (pid > 0 && waitpid(pid, &status, 0) == pid)
+            last_status = WEXITSTATUS(status);
+    }
+
+    command_free(c);
+    trace_span("substitute", subst_start, NULL);
+}
+
+
+// command_append_glob(c, word, quoted)
+//    Add the command word `word` to `c`, replacing it with the sorted list
+//    of matching paths if it is an unquoted glob pattern that matches
+//    anything. Unmatched patterns are passed through unchanged.
+
+static void command_append_glob(command* c, char* word, int quoted) {
+    char** matches;
+    int n;
+    if (quoted || !expand_has_magic(word)
+        || (n = expand_glob(word, &matches)) == 0) {
+        command_append_arg(c, word);
+        return;
+    }
+
+    // only the largest expansion is split across batches; the arguments
+    // around it, including other expansions, go to every batch
+    if (c->expand_first < 0 || n > c->expand_last - c->expand_first + 1) {
+        c->expand_first = c->argc;
+        c->expand_last = c->argc + n - 1;
+    }
+    for (int i = 0; i < n; ++i)
+        command_append_arg(c, matches[i]);
+    free(matches);
+    free(word);
+}
+
+
+// substitute_word(word)
+//    Free `word` and return a newly allocated copy with each command
+//    substitution replaced by its output minus trailing newlines.
+
+static char* substitute_word(char* word) {
+    capture cap = { NULL, 0, 0 };
+    char* p = word;
+    char* begin;
+    while ((begin = strchr(p, SUBST_BEGIN)) != NULL) {
+        capture_append(&cap, p, begin - p);
+        char* end = strchr(begin, SUBST_END);
+        *end = '\0';
+        size_t length = cap.length;
+        substitute(begin + 1, &cap);
+        while (cap.length > length && cap.s[cap.length - 1] == '\n')
+            --cap.length;
+        p = end + 1;
+    }
+    capture_append(&cap, p, strlen(p) + 1);
+    free(word);
+    return cap.s;
+}
+
+
+// command_append_word(c, word, quoted)
+//    Add the command word `word` to `c`. Command substitutions in `word`
+//    are replaced by their output minus trailing newlines. Unless the word
+//    was quoted, the result is then split into fields at whitespace, and
+//    each field is subject to pathname expansion.
+
+static void command_append_word(command* c, char* word, int quoted) {
+    // a leading `@SPEC` word sets the command's scheduling policy
+    if (c->argc == 0 && word[0] == '@' && !quoted) {
+        c->policy = foreground_policy;
+        c->has_policy = policy_parse(word + 1, &c->policy) == 0;
+        if (!c->has_policy)
+            fprintf(stderr, "sh61: %s: bad scheduling policy\n", word + 1);
+        free(word);
+        return;
+    }
+
+    if (!strchr(word, SUBST_BEGIN)) {
+        command_append_glob(c, word, quoted);
+        return;
+    }
+
+    word = substitute_word(word);
+    if (quoted) {
+        command_append_arg(c, word);
+        return;
+    }
+    char* saveptr;
+    for (char* field = strtok_r(word, " \t\n", &saveptr); field;
+         field = strtok_r(NULL, " \t\n", &saveptr))
+        command_append_glob(c, strdup(field), 0);
+    free(word);
+}
+
+
+// command_expand(c)
+//    Expand the words and redirection targets of `c` that were left for
+//    when it runs (see parse_word). Called just before `c` starts, so
+//    substitutions see the effects of the commands before it, and those
+//    of a command `&&` or `||` skips never run.
+
+static void command_expand(command* c) {
+    if (!c->dynamic)
+        return;
+    c->dynamic = 0;
+
+    char** words = c->argv;
+    int n = c->argc;
+    c->argv = NULL;
+    c->argc = c->capacity = 0;
+    for (int i = 0; i < n; ++i)
+        if (words[i][0] == WORD_EXPAND || words[i][0] == WORD_EXPAND_QUOTED) {
+            int quoted = words[i][0] == WORD_EXPAND_QUOTED;
+            memmove(words[i], words[i] + 1, strlen(words[i]));
+            command_append_word(c, words[i], quoted);
+        } else
+            command_append_arg(c, words[i]);
+    free(words);
+
+    // a redirection target gets substitution, but no splitting or globbing
+    for (redirect* red = c->redirection; red; red = red->next)
+        if (red->file && strchr(red->file, SUBST_BEGIN))
+            red->file = substitute_word(red->file);
+}
+
+
+// word_is_quoted(p, end)
+//    Return 1 if the raw word text from `p` to `end` contains quotes or
+//    backslashes outside of command substitutions. Such words are never
+//    glob patterns or split into fields.
+
+static int word_is_quoted(const char* p, const char* end) {
+    int depth = 0;
+    for (; p < end; ++p)
+        if (*p == '$' && p + 1 < end && p[1] == '(') {
+            ++depth;
+            ++p;
+        } else if (depth && *p == '(')
+            ++depth;
+        else if (depth && *p == ')')
+            --depth;
+        else if (!depth && (*p == '"' || *p == '\'' || *p == '\\'))
+            return 1;
+    return 0;
+}
+
+
+// word_is_dynamic(c, word, quoted)
+//    Return 1 if adding `word` to `c` does more than store it: command
+//    substitution, pathname expansion, or an `@SPEC` prefix.
+
+static int word_is_dynamic(command* c, const char* word, int quoted) {
+    return strchr(word, SUBST_BEGIN) != NULL
+        || (!quoted && (expand_has_magic(word)
+                        || (c->argc == 0 && word[0] == '@')));
+}
+
+
+// parse_word(c, word, quoted)
+//    Add the command word `word` to `c`. A word that needs expanding is
+//    stored behind a WORD_EXPAND or WORD_EXPAND_QUOTED marker, and `c` is
+//    marked dynamic, for command_expand to handle when `c` runs.
+
+static void parse_word(command* c, char* word, int quoted) {
+    if (word_is_dynamic(c, word, quoted)) {
+        char* marked = (char*) malloc(strlen(word) + 2);
+        marked[0] = quoted ? WORD_EXPAND_QUOTED : WORD_EXPAND;
+        strcpy(marked + 1, word);
+        free(word);
+        word = marked;
+        c->dynamic = 1;
+    }
+    command_append_arg(c, word);
+}
+
+
+// parse_line(s)
+//    Parse the command list in `s` and return it. The first command's
+//    `argc` is 0 if the line is empty. Nothing is expanded yet.
+
+static command* parse_line(const char* s) {
     int type;
     char* token;
     // Your code here!
 
+    // start of the raw text of the current token
+    const char* word;
+
     // build the command
     command* c = command_alloc();
     
@@ -499,7 +1377,10 @@ void eval_line(const char* s) {
     int last = 0;
     
     // while there are commands left to be parsed
-    while ((s = parse_shell_token(s, &type, &token)) != NULL) {
+    while ((s = parse_shell_token(word = s, &type, &token)) != NULL) {
+    
+        // words written with quotes or backslashes are never glob patterns
+        int quoted = word_is_quoted(word, s);
     
         // if previous token was last in command
         if(last) {
@@ -516,7 +1397,7 @@ void eval_line(const char* s) {
             c = c->next;
             
             // append the token to incremented command struct
-            command_append_arg(c, token);
+            parse_word(c, token, quoted);
             
             // no longer the last token in command
             last = 0;
@@ -535,6 +1416,8 @@ void eval_line(const char* s) {
             
             // set the file in the redirect struct
             red->file = token;
+            if (token && strchr(token, SUBST_BEGIN))
+                c->dynamic = 1;
             
             // insert at thead of linked list
             red->next = c->redirection;
@@ -576,27 +1459,108 @@ void eval_line(const char* s) {
         
         // otherwise just append the token
         else
-            command_append_arg(c, token);
+            parse_word(c, token, quoted);
     }
-        
-      // execute it
+
+    return start;
+}
+
+
+// eval_list(start)
+//    Optimize the parsed command list `start`, run it via `run_list`, and
+//    free it.
+
+static void eval_list(command* start) {
+    // rewrite it
+    int folded_status = -1;
     if (start->argc)
+        start = optimize_list(start, &folded_status);
+    if (explain_plan && start && start->argc)
+        explain_list(start);
+    
+      // execute it
+    if (start && start->argc)
         run_list(start);
+    if (folded_status >= 0)
+        last_status = folded_status;
     command_free(start);
+}
+
+
+// eval_line(c)
+//    Parse the command list in `s` and run it via `run_list`.
+
+void eval_line(const char* s) {
+    // time spent parsing, for tracing
+    unsigned long long parse_start = trace_now();
+
+    command* start = parse_line(s);
+    trace_span("parse", parse_start, NULL);
+    eval_list(start);
 }        
 
 
-int main(int argc, char* argv[]) {
-    
+// open_script(argc, argv, quiet)
+//    Process sh61's command-line options and return the file to read
+//    commands from. Sets `*quiet` if prompts should be suppressed. Used by
+//    `main` and by nested sh61 invocations run inline.
+
+static FILE* open_script(int argc, char* argv[], int* quiet) {
     FILE* command_file = stdin;
-    int quiet = 0;
+    const char* compile_output = NULL;
+    int compile = 0;
+    *quiet = 0;
 
-    // Check for '-q' option: be quiet (print no prompts)
-    if (argc > 1 && strcmp(argv[1], "-q") == 0) {
-        quiet = 1;
+    // Check for options:
+    //    '-q': be quiet (print no prompts)
+    //    '-b': split expanded argument lists too long for one exec
+    //          into several executions
+    //    '--explain': print each command line as optimized before running it
+    //    '--bg=SPEC': scheduling policy for background jobs (see policy.c)
+    //    '--compile': compile the script instead of running it
+    //    '-o FILE': where to write the compiled script
+    while (argc > 1) {
+        if (strcmp(argv[1], "-q") == 0)
+            *quiet = 1;
+        else if (strcmp(argv[1], "-b") == 0)
+            batch_args = 1;
+        else if (strcmp(argv[1], "--explain") == 0)
+            explain_plan = 1;
+        else if (strncmp(argv[1], "--bg=", 5) == 0) {
+            if (policy_parse(argv[1] + 5, &background_policy) == -1) {
+                fprintf(stderr, "sh61: %s: bad scheduling policy\n", argv[1] + 5);
+                exit(1);
+            }
+        } else if (strcmp(argv[1], "--compile") == 0)
+            compile = 1;
+        else if (strcmp(argv[1], "-o") == 0 && argc > 2) {
+            compile_output = argv[2];
+            --argc, ++argv;
+        } else
+            break;
         --argc, ++argv;
     }
 
+    // Compile the script, by default to `script.sh61c`. `-o` may also
+    // follow the script's name. This may be running inline in a child, so
+    // exit with child_exit.
+    if (compile) {
+        if (argc > 3 && strcmp(argv[2], "-o") == 0)
+            compile_output = argv[3];
+        if (argc < 2) {
+            fprintf(stderr, "Usage: sh61 --compile SCRIPT [-o OUTPUT]\n");
+            child_exit(1);
+        }
+        char output[BUFSIZ];
+        size_t len = strlen(argv[1]);
+        if (!compile_output && len > 3 && strcmp(argv[1] + len - 3, ".sh") == 0)
+            snprintf(output, sizeof(output), "%.*s.sh61c", (int) len - 3, argv[1]);
+        else if (!compile_output)
+            snprintf(output, sizeof(output), "%s.sh61c", argv[1]);
+        child_exit(compile_script(argv[1], compile_output ? compile_output : output)
+                   == 0 ? 0 : 1);
+    }
+
     // Check for filename option: read commands from file
     if (argc > 1) {
         command_file = fopen(argv[1], "rb");
@@ -605,16 +1569,355 @@ int main(int argc, char* argv[]) {
             exit(1);
         }
     }
+    return command_file;
+}
+
+
+// PREFETCH
+//
+//    When commands come from a regular file, the lines after the current
+//    one are parsed ahead of time and the kernel is asked to start reading
+//    their binaries and `<` input files into the page cache, so that I/O
+//    overlaps with the command currently running.
+
+#define PREFETCH_LINES      8       // how many lines to look ahead
+#define PREFETCH_CACHE      32      // recently prefetched binaries remembered
+
+static char* prefetched_binaries[PREFETCH_CACHE];
+static int prefetched_next = 0;
+
+
+// prefetch_file(path)
+//    Start reading `path` into the page cache without waiting for it.
+//    Only regular files are touched: opening a FIFO would release a writer
+//    blocked in `open`, which then dies of SIGPIPE when we close it.
+
+static void prefetch_file(const char* path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
 
-    // - Put the shell into the foreground
-    // - Ignore the SIGTTOU signal, which is sent when the shell is put back
-    //   into the foreground
-    set_foreground(0);
-    handle_signal(SIGTTOU, SIG_IGN);
 
+// prefetch_binary(name)
+//    Resolve the command `name` through PATH and prefetch it, unless it
+//    was prefetched recently.
+
+static void prefetch_binary(const char* name) {
+    char path[BUFSIZ];
+    for (int i = 0; i < PREFETCH_CACHE; ++i)
+        if (prefetched_binaries[i] && strcmp(prefetched_binaries[i], name) == 0)
+            return;
+    if (strcmp(name, "cd") == 0 || !command_path(name, path, sizeof(path)))
+        return;
+
+    prefetch_file(path);
+    free(prefetched_binaries[prefetched_next]);
+    prefetched_binaries[prefetched_next] = strdup(name);
+    prefetched_next = (prefetched_next + 1) % PREFETCH_CACHE;
+}
+
+
+// prefetch_line(s)
+//    Prefetch the binaries and input files used by the command line `s`.
+
+static void prefetch_line(const char* s) {
+    int type;
+    char* token;
+    int first = 1;
+    while ((s = parse_shell_token(s, &type, &token)) != NULL) {
+        if (type == TOKEN_REDIRECTION) {
+            int input = strcmp(token, "<") == 0;
+            free(token);
+            s = parse_shell_token(s, &type, &token);
+            if (s && input && type == TOKEN_NORMAL)
+                prefetch_file(token);
+        } else if (type == TOKEN_NORMAL) {
+            if (first)
+                prefetch_binary(token);
+            first = 0;
+        } else
+            first = 1;
+        free(token);
+        if (!s)
+            break;
+    }
+}
+
+
+// prefetch_script(command_file, prefetched_to)
+//    Prefetch for the next few complete lines of `command_file` past the
+//    current position, skipping those already handled (everything before
+//    file offset `*prefetched_to`). The file is read with `pread`, so the
+//    stream's position and buffer are untouched.
+
+static void prefetch_script(FILE* command_file, off_t* prefetched_to) {
+    int fd = fileno(command_file);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+    off_t pos = ftello(command_file);
+    if (pos == -1)
+        return;
+
+    unsigned long long prefetch_start = trace_now();
+    char buf[BUFSIZ * 2];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, pos);
+    if (n <= 0)
+        return;
+    buf[n] = '\0';
+
+    char* line = buf;
+    for (int i = 0; i < PREFETCH_LINES; ++i) {
+        char* end = strchr(line, '\n');
+        if (!end)
+            break;
+        *end = '\0';
+        off_t line_end = pos + (end + 1 - buf);
+        if (line_end > *prefetched_to) {
+            prefetch_line(line);
+            *prefetched_to = line_end;
+        }
+        line = end + 1;
+    }
+    trace_span("prefetch", prefetch_start, NULL);
+}
+
+
+// COMPILED SCRIPTS
+//
+//    `sh61 --compile` writes each line of a script as its parsed command
+//    list (file format in compile.c). Running the compiled file skips
+//    tokenizing entirely: each line's commands are filled in from the
+//    mapping into one set of structures reused for every line, with argv
+//    pointing at the mapped strings. Lines whose words must be expanded
+//    when they run (globs, `$(...)`, `@SPEC`) are stored as text and go
+//    through eval_line as usual.
+
+
+// compile_script(source, output)
+//    Compile the script file `source` to `output`, one entry for each line
+//    run_script would evaluate. Returns 0 on success, -1 on failure.
+
+static int compile_script(const char* source, const char* output) {
+    FILE* f = fopen(source, "rb");
+    if (!f) {
+        perror(source);
+        return -1;
+    }
+    compiled_script cs;
+    int compiled = compiled_map(fileno(f), &cs);
+    if (compiled != 0) {
+        if (compiled == 1)
+            compiled_unmap(&cs);
+        fprintf(stderr, "sh61: %s: already compiled\n", source);
+        fclose(f);
+        return -1;
+    }
+    sh61c_writer* w = sh61c_begin(source);
+    if (!w) {
+        fclose(f);
+        return -1;
+    }
+
+    // split lines exactly as run_script does
+    char buf[BUFSIZ];
+    int bufpos = 0;
+    while (fgets(&buf[bufpos], BUFSIZ - bufpos, f)) {
+        bufpos = strlen(buf);
+        if (bufpos != BUFSIZ - 1 && buf[bufpos - 1] != '\n')
+            continue;
+        bufpos = 0;
+
+        // lines with words to expand, or a missing redirection target,
+        // are kept as text
+        int dynamic = 0;
+        command* start = parse_line(buf);
+        for (command* c = start; c; c = c->next) {
+            dynamic |= c->dynamic;
+            for (redirect* red = c->redirection; red; red = red->next)
+                dynamic |= red->file == NULL;
+        }
+        if (!start->argc)
+            sh61c_begin_line(w, "");
+        else if (dynamic)
+            sh61c_begin_line(w, buf);
+        else {
+            sh61c_begin_line(w, NULL);
+            for (command* c = start; c; c = c->next) {
+                sh61c_add_command(w, c->argc, c->argv, c->condition_type, c->bg);
+                for (redirect* red = c->redirection; red; red = red->next)
+                    sh61c_add_redirect(w, red->token, red->file);
+            }
+        }
+        command_free(start);
+    }
+
+    if (ferror(f)) {
+        perror(source);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return sh61c_finish(w, output);
+}
+
+
+// compiled_build(cs, line, cmds, argv, reds)
+//    Fill in the command list for compiled line `line` and return it,
+//    linked the way parse_line links it. `cmds`, `argv` and `reds` have
+//    room for the script's largest line.
+
+static command* compiled_build(const compiled_script* cs, const sh61c_line* line,
+                               command* cmds, char** argv, redirect* reds) {
+    for (uint32_t i = 0; i < line->ncommands; ++i) {
+        const sh61c_command* cc = &cs->commands[line->first + i];
+        const uint32_t* words = &cs->words[cc->first];
+        command* c = &cmds[i];
+
+        c->argc = cc->argc;
+        c->argv = cc->argc ? argv : NULL;
+        c->capacity = cc->argc + 1;
+        for (uint32_t j = 0; j < cc->argc; ++j)
+            *argv++ = (char*) cs->strings + words[j];
+        if (cc->argc)
+            *argv++ = NULL;
+
+        c->redirection = NULL;
+        redirect** tail = &c->redirection;
+        for (uint32_t j = 0; j < cc->nredirects; ++j, ++reds) {
+            reds->token = (char*) cs->strings + words[cc->argc + 2 * j];
+            reds->file = (char*) cs->strings + words[cc->argc + 2 * j + 1];
+            reds->next = NULL;
+            reds->borrowed = 1;
+            *tail = reds;
+            tail = &reds->next;
+        }
+
+        c->expand_first = c->expand_last = -1;
+        c->pid = -1;
+        c->bg = cc->bg;
+        c->status = 0;
+        c->next = i + 1 < line->ncommands ? c + 1 : NULL;
+        // parse_line never sets the last command's `prev`
+        c->prev = i > 0 && i + 1 < line->ncommands ? c - 1 : NULL;
+        c->condition_type = cc->condition_type;
+        c->echo_to_pipe = 0;
+        c->has_policy = 0;
+        c->borrowed = 1;
+    }
+    return cmds;
+}
+
+
+// prefetch_compiled(cs, next, prefetched_to)
+//    Like prefetch_script, for a compiled script: prefetch for the lines
+//    from index `next` on, skipping those before `*prefetched_to`.
+
+static void prefetch_compiled(const compiled_script* cs, uint32_t next,
+                              uint32_t* prefetched_to) {
+    uint32_t end = next + PREFETCH_LINES;
+    if (end > cs->header->nlines)
+        end = cs->header->nlines;
+    if (*prefetched_to < next)
+        *prefetched_to = next;
+    if (*prefetched_to >= end)
+        return;
+
+    unsigned long long prefetch_start = trace_now();
+    for (; *prefetched_to < end; ++*prefetched_to) {
+        const sh61c_line* line = &cs->lines[*prefetched_to];
+        if (line->ncommands == 0)
+            prefetch_line(cs->strings + line->text);
+        for (uint32_t i = 0; i < line->ncommands; ++i) {
+            const sh61c_command* cc = &cs->commands[line->first + i];
+            const uint32_t* words = &cs->words[cc->first];
+            if (cc->argc)
+                prefetch_binary(cs->strings + words[0]);
+            for (uint32_t j = 0; j < cc->nredirects; ++j)
+                if (strcmp(cs->strings + words[cc->argc + 2 * j], "<") == 0)
+                    prefetch_file(cs->strings + words[cc->argc + 2 * j + 1]);
+        }
+    }
+    trace_span("prefetch", prefetch_start, NULL);
+}
+
+
+// run_compiled(cs, quiet)
+//    Run the compiled script `cs` as run_script would run its source.
+
+static void run_compiled(const compiled_script* cs, int quiet) {
+    const sh61c_header* h = cs->header;
+    command* cmds = (command*) malloc(sizeof(command) * h->max_commands);
+    char** argv = (char**) malloc(sizeof(char*) * (h->max_args + h->max_commands));
+    redirect* reds = (redirect*) malloc(sizeof(redirect) * h->max_redirects);
+    uint32_t prefetched_to = 0;
+
+    for (uint32_t i = 0; ; ++i) {
+        sig_received = 0;
+        foreground = 0;
+        // run_script prompts once more before it sees end of file
+        if (!quiet) {
+            printf("sh61[%d]$ ", getpid());
+            fflush(stdout);
+        }
+        if (i == h->nlines)
+            break;
+
+        prefetch_compiled(cs, i + 1, &prefetched_to);
+        const sh61c_line* line = &cs->lines[i];
+        if (line->ncommands == 0) {
+            if (cs->strings[line->text])
+                eval_line(cs->strings + line->text);
+        } else {
+            unsigned long long build_start = trace_now();
+            command* start = compiled_build(cs, line, cmds, argv, reds);
+            trace_span("build", build_start, NULL);
+            eval_list(start);
+        }
+    }
+
+    free(cmds);
+    free(argv);
+    free(reds);
+}
+
+
+// run_script(command_file, quiet)
+//    Read and run commands from `command_file` until end of file. A
+//    compiled script runs from its mapping instead, or from its source if
+//    that has changed since it was compiled.
+
+static void run_script(FILE* command_file, int quiet) {
     char buf[BUFSIZ];
     int bufpos = 0;
     int needprompt = 1;
+    off_t prefetched_to = 0;
+
+    compiled_script cs;
+    int compiled = compiled_map(fileno(command_file), &cs);
+    if (compiled == 1 && !compiled_stale(&cs)) {
+        run_compiled(&cs, quiet);
+        compiled_unmap(&cs);
+        return;
+    } else if (compiled == 1) {
+        const char* source = cs.strings + cs.header->source;
+        FILE* source_file = fopen(source, "rb");
+        if (!source_file)
+            perror(source);
+        compiled_unmap(&cs);
+        if (source_file) {
+            run_script(source_file, quiet);
+            fclose(source_file);
+        }
+        return;
+    } else if (compiled == -1)
+        child_exit(1);
 
     while (!feof(command_file)) {
         sig_received = 0;
@@ -627,8 +1930,12 @@ int main(int argc, char* argv[]) {
             needprompt = 0;
         }
 
-        // Read a string, checking for error or EOF
-        if (fgets(&buf[bufpos], BUFSIZ - bufpos, command_file) == NULL) {
+        // Read a string, checking for error or EOF; the time spent here is
+        // the shell sitting idle
+        unsigned long long read_start = trace_now();
+        char* line = fgets(&buf[bufpos], BUFSIZ - bufpos, command_file);
+        trace_span("read", read_start, NULL);
+        if (line == NULL) {
             if (ferror(command_file) && errno == EINTR) {
                 // ignore EINTR errors
                 clearerr(command_file);
@@ -643,6 +1950,7 @@ int main(int argc, char* argv[]) {
         // If a complete command line has been provided, run it
         bufpos = strlen(buf);
         if (bufpos == BUFSIZ - 1 || (bufpos > 0 && buf[bufpos - 1] == '\n')) {
+            prefetch_script(command_file, &prefetched_to);
             eval_line(buf);
             bufpos = 0;
             needprompt = 1;
@@ -651,6 +1959,24 @@ int main(int argc, char* argv[]) {
         // Handle zombie processes and/or interrupt requests
         // Your code here!
     }
+}
+
+
+int main(int argc, char* argv[]) {
+    
+    int quiet;
+    FILE* command_file = open_script(argc, argv, &quiet);
+
+    // - Put the shell into the foreground
+    // - Ignore the SIGTTOU signal, which is sent when the shell is put back
+    //   into the foreground
+    set_foreground(0);
+    handle_signal(SIGTTOU, SIG_IGN);
+
+    // Start recording a timeline if SH61_TRACE is set
+    trace_init();
+
+    run_script(command_file, quiet);
 
     return 0;
 }
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/resource.h>
+#include <stdint.h>
 
 #define TOKEN_NORMAL        0   // normal command word
 #define TOKEN_REDIRECTION   1   // redirection operator (>, <, 2>)
@@ -23,6 +25,15 @@
 #define TOKEN_RPAREN        8   // `)` operator
 #define TOKEN_OTHER         -1
 
+// Command substitution markers in parsed tokens.
+#define SUBST_BEGIN         '\001'
+#define SUBST_END           '\002'
+
+// First character of a parsed word that is expanded only when its command
+// runs (substitution, globbing, `@SPEC`); the word follows.
+#define WORD_EXPAND         '\003'
+#define WORD_EXPAND_QUOTED  '\004' // quoted: substitution only, no splitting
+
 // parse_shell_token(str, type, token)
 //    Parse the next token from the shell command `str`. Stores the type of
 //    the token in `*type`; this is one of the TOKEN_ constants. Stores the
@@ -31,6 +42,9 @@
 //
 //    At the end of the string, returns NULL, sets `*type` to TOKEN_SEQUENCE,
 //    and sets `*token` to NULL.
+//
+//    A command substitution `$(...)` in a normal token is stored as its raw
+//    body between SUBST_BEGIN and SUBST_END characters.
 const char* parse_shell_token(const char* str, int* type, char** token);
 
 // set_foreground(pgid)
@@ -49,4 +63,102 @@ static inline int handle_signal(int signo, void (*handler)(int)) {
     return sigaction(signo, &sa, NULL);
 }
 
+// Pathname expansion (expand.c).
+int expand_has_magic(const char* word);
+int expand_match(const char* pattern, const char* name);
+int expand_glob(const char* pattern, char*** matches);
+
+// Job scheduling policies (policy.c).
+#define POLICY_CPU_DEFAULT  0   // leave the CPU scheduling class alone
+#define POLICY_CPU_BATCH    1   // SCHED_BATCH
+#define POLICY_CPU_IDLE     2   // SCHED_IDLE
+#define POLICY_IO_DEFAULT   0   // leave the I/O priority alone
+#define POLICY_IO_BE        2   // best-effort I/O class
+#define POLICY_IO_IDLE      3   // idle I/O class
+
+typedef struct sched_policy {
+    int cpu;            // one of the POLICY_CPU_ constants
+    int nice;           // nice increment
+    int io;             // one of the POLICY_IO_ constants
+    rlim_t cpu_limit;   // RLIMIT_CPU in seconds, or RLIM_INFINITY
+    rlim_t mem_limit;   // RLIMIT_AS in bytes, or RLIM_INFINITY
+} sched_policy;
+
+extern sched_policy background_policy;
+extern sched_policy foreground_policy;
+int policy_parse(const char* spec, sched_policy* p);
+void policy_reset(void);
+void policy_apply(const sched_policy* p);
+
+// Precompiled scripts (compile.c). `sh61 --compile` stores each line of a
+// script as its parsed command list; every reference in the file is an
+// index or offset into one of its sections, never a pointer.
+#define SH61C_MAGIC         "sh61c\0\0\1"  // 8 bytes, including format version
+
+typedef struct sh61c_header {
+    char magic[8];              // SH61C_MAGIC
+    uint64_t source_mtime;      // source file's modification time in ns
+    uint64_t source_size;       // source file's size
+    uint64_t source_hash;       // FNV-1a hash of the source file
+    uint32_t source;            // string offset of the source's absolute path
+    uint32_t nlines;            // entries in the line table
+    uint32_t max_commands;      // most commands on one line
+    uint32_t max_args;          // most arguments on one line
+    uint32_t max_redirects;     // most redirections on one line
+    uint32_t lines;             // file offset of the line table
+    uint32_t commands;          // file offset of the command table
+    uint32_t words;             // file offset of the word table
+    uint32_t strings;           // file offset of the string pool
+    uint32_t strings_size;      // size of the string pool
+} sh61c_header;
+
+typedef struct sh61c_line {
+    uint32_t ncommands;         // 0: parse `text` at run time instead
+    uint32_t first;             // index of the first command
+    uint32_t text;              // string offset of the line, if ncommands == 0
+} sh61c_line;
+
+typedef struct sh61c_command {
+    uint32_t first;             // word index of argv[0]; then the redirections'
+                                // token/file pairs, in list order
+    uint16_t argc;              // (a BUFSIZ line can't hold more)
+    uint16_t nredirects;
+    int8_t condition_type;
+    uint8_t bg;
+    uint16_t unused;
+} sh61c_command;
+
+typedef struct compiled_script {
+    void* map;                  // the mapped file
+    size_t size;
+    const sh61c_header* header;
+    const sh61c_line* lines;
+    const sh61c_command* commands;
+    const uint32_t* words;      // string offsets
+    const char* strings;
+} compiled_script;
+
+typedef struct sh61c_writer sh61c_writer;
+sh61c_writer* sh61c_begin(const char* source);
+void sh61c_begin_line(sh61c_writer* w, const char* text);
+void sh61c_add_command(sh61c_writer* w, int argc, char** argv,
+                       int condition_type, int bg);
+void sh61c_add_redirect(sh61c_writer* w, const char* token, const char* file);
+int sh61c_finish(sh61c_writer* w, const char* output);
+int compiled_map(int fd, compiled_script* cs);
+int compiled_stale(const compiled_script* cs);
+void compiled_unmap(compiled_script* cs);
+
+// Execution timeline tracing (trace.c). Enabled by SH61_TRACE=file.json;
+// every function is a no-op when tracing is off.
+extern int trace_enabled;
+void trace_init(void);
+void trace_flush(void);
+unsigned long long trace_now(void);
+void trace_span(const char* name, unsigned long long start, const char* args);
+void trace_instant(const char* name, const char* args);
+void trace_begin(const char* name, pid_t pid, const char* args);
+void trace_end(const char* name, pid_t pid);
+void trace_after_fork(void);
+
 #endif
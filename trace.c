@@ -0,0 +1,206 @@
+#include "sh61.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Execution timeline tracing.
+//
+//    When SH61_TRACE=file.json is set, the shell records spans for parsing,
+//    forking, child execution, conditional decisions and idle time spent
+//    reading input. Events go into a fixed-size per-process ring buffer and
+//    are only formatted when the buffer is flushed, so recording an event
+//    costs a clock read and a few stores.
+//
+//    The output is the Chrome/Perfetto trace-event "JSON Array Format". Every
+//    process (the shell and each forked child) appends whole lines to the
+//    same file with O_APPEND, so events from different processes never
+//    interleave within a line. The closing `]` is left off, which that
+//    format explicitly allows, because background children may still be
+//    writing after the shell exits.
+
+#define TRACE_RING_SIZE     1024    // events per process; a power of two
+#define TRACE_NAME_SIZE     32
+#define TRACE_ARGS_SIZE     96
+
+typedef struct trace_event {
+    char ph;                        // phase: 'X' span, 'B'/'E' begin/end, 'i' instant
+    pid_t pid;                      // process the event belongs to
+    unsigned long long ts;          // start time in ns (CLOCK_MONOTONIC)
+    unsigned long long dur;         // duration in ns ('X' events only)
+    char name[TRACE_NAME_SIZE];     // event name
+    char args[TRACE_ARGS_SIZE];     // JSON object members for "args", or ""
+} trace_event;
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static trace_event trace_ring[TRACE_RING_SIZE];
+static unsigned trace_head = 0;     // next slot to write
+static unsigned trace_tail = 0;     // oldest unflushed slot
+
+
+// trace_now()
+//    Return the current monotonic time in nanoseconds.
+
+unsigned long long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// trace_init()
+//    Start tracing if SH61_TRACE names an output file. A nested sh61 sees
+//    SH61_TRACE_PARENT and appends to its parent's trace instead of
+//    truncating it.
+
+void trace_init(void) {
+    const char* path = getenv("SH61_TRACE");
+    if (!path || !*path)
+        return;
+
+    int nested = getenv("SH61_TRACE_PARENT") != NULL;
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    if (!nested)
+        flags |= O_TRUNC;
+    int fd = open(path, flags, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "sh61: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // move the fd out of the way of pipes and redirections
+    trace_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    if (trace_fd == -1)
+        return;
+
+    trace_enabled = 1;
+    if (!nested) {
+        char pidbuf[32];
+        snprintf(pidbuf, sizeof(pidbuf), "%d", getpid());
+        setenv("SH61_TRACE_PARENT", pidbuf, 1);
+        write(trace_fd, "[\n", 2);
+    }
+    atexit(trace_flush);
+}
+
+
+// trace_append_escaped(buf, pos, size, str)
+//    Append `str` to `buf` as the contents of a JSON string.
+
+static int trace_append_escaped(char* buf, int pos, int size, const char* str) {
+    for (; *str && pos < size - 2; ++str) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            buf[pos++] = '\\';
+            buf[pos++] = ch;
+        } else if (ch < 0x20)
+            buf[pos++] = '?';
+        else
+            buf[pos++] = ch;
+    }
+    return pos;
+}
+
+
+// trace_flush()
+//    Format every buffered event and append them to the trace file in a
+//    single write. Called when the ring fills, before a child execs, and
+//    at exit.
+
+void trace_flush(void) {
+    if (trace_fd < 0 || trace_tail == trace_head)
+        return;
+
+    // each formatted event is bounded by the field sizes plus fixed text
+    static char out[TRACE_RING_SIZE * (TRACE_NAME_SIZE * 2 + TRACE_ARGS_SIZE + 128)];
+    int pos = 0;
+
+    for (; trace_tail != trace_head; ++trace_tail) {
+        trace_event* e = &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+        pos += sprintf(out + pos, "{\"name\":\"");
+        pos = trace_append_escaped(out, pos, sizeof(out), e->name);
+        pos += sprintf(out + pos,
+                       "\",\"cat\":\"sh61\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+                       "\"ts\":%llu.%03llu",
+                       e->ph, e->pid, e->pid, e->ts / 1000, e->ts % 1000);
+        if (e->ph == 'X')
+            pos += sprintf(out + pos, ",\"dur\":%llu.%03llu",
+                           e->dur / 1000, e->dur % 1000);
+        if (e->ph == 'i')
+            pos += sprintf(out + pos, ",\"s\":\"p\"");
+        if (e->args[0])
+            pos += sprintf(out + pos, ",\"args\":{%s}", e->args);
+        pos += sprintf(out + pos, "},\n");
+    }
+
+    write(trace_fd, out, pos);
+}
+
+
+// trace_record(ph, pid, name, ts, dur, args)
+//    Claim the next ring slot and fill it in. If the ring is full, flush it
+//    first, so no event is ever dropped.
+
+static void trace_record(char ph, pid_t pid, const char* name,
+                         unsigned long long ts, unsigned long long dur,
+                         const char* args) {
+    if (trace_head - trace_tail == TRACE_RING_SIZE)
+        trace_flush();
+
+    unsigned slot = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_event* e = &trace_ring[slot & (TRACE_RING_SIZE - 1)];
+    e->ph = ph;
+    e->pid = pid;
+    e->ts = ts;
+    e->dur = dur;
+    strncpy(e->name, name ? name : "", TRACE_NAME_SIZE - 1);
+    e->name[TRACE_NAME_SIZE - 1] = '\0';
+    strncpy(e->args, args ? args : "", TRACE_ARGS_SIZE - 1);
+    e->args[TRACE_ARGS_SIZE - 1] = '\0';
+}
+
+
+// trace_span(name, start, args)
+//    Record a complete span for this process that began at `start` (from
+//    `trace_now`) and ends now.
+
+void trace_span(const char* name, unsigned long long start, const char* args) {
+    if (trace_enabled)
+        trace_record('X', getpid(), name, start, trace_now() - start, args);
+}
+
+
+// trace_instant(name, args)
+//    Record a zero-length event for this process.
+
+void trace_instant(const char* name, const char* args) {
+    if (trace_enabled)
+        trace_record('i', getpid(), name, trace_now(), 0, args);
+}
+
+
+// trace_begin(name, pid, args), trace_end(name, pid)
+//    Record the beginning or end of an open span on process `pid`'s track.
+//    A child calls `trace_begin` just before it execs, and the shell calls
+//    `trace_end` once it has reaped that child.
+
+void trace_begin(const char* name, pid_t pid, const char* args) {
+    if (trace_enabled)
+        trace_record('B', pid, name, trace_now(), 0, args);
+}
+
+void trace_end(const char* name, pid_t pid) {
+    if (trace_enabled)
+        trace_record('E', pid, name, trace_now(), 0, NULL);
+}
+
+
+// trace_after_fork()
+//    Called in a newly forked child: forget the events inherited from the
+//    parent, which the parent will write out itself.
+
+void trace_after_fork(void) {
+    trace_tail = trace_head;
+}